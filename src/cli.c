@@ -18,6 +18,13 @@
 #define DEFAULT_TREEMAP_THRESHOLD 0.0005
 
 #define DEFAULT_MAX_MEM_BUFFER 2000
+#define DEFAULT_MAX_SPILL_SIZE 8000
+#define DEFAULT_STORE_GROWTH_CAP 1024
+
+#define DEFAULT_COMPRESSION_LEVEL 10
+#define FAST_OUTPUT_COMPRESSION_LEVEL 1
+#define DEFAULT_COMPRESSION_FRAME_SIZE 4096
+#define DEFAULT_DICT_COMPRESSION_FRAME_SIZE 128
 
 const char *TESS_DATAPATHS[] = {
         "/usr/share/tessdata/",
@@ -32,6 +39,9 @@ scan_args_t *scan_args_create() {
     scan_args_t *args = calloc(sizeof(scan_args_t), 1);
 
     args->depth = -1;
+    // Unset, see --fast-output
+    args->compression_level = -1;
+    args->compression_threads = -1;
 
     return args;
 }
@@ -41,6 +51,18 @@ exec_args_t *exec_args_create() {
     return args;
 }
 
+compact_args_t *compact_args_create() {
+    compact_args_t *args = calloc(sizeof(compact_args_t), 1);
+    return args;
+}
+
+void compact_args_destroy(compact_args_t *args) {
+    if (args->index_path != NULL) {
+        free(args->index_path);
+    }
+    free(args);
+}
+
 void scan_args_destroy(scan_args_t *args) {
     if (args->name != NULL) {
         free(args->name);
@@ -54,6 +76,9 @@ void scan_args_destroy(scan_args_t *args) {
     if (args->output != NULL) {
         free(args->output);
     }
+    if (args->spill_dir != NULL) {
+        free(args->spill_dir);
+    }
     free(args);
 }
 
@@ -113,6 +138,30 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         return 1;
     }
 
+    args->thumbnail_tiers.count = 0;
+    if (args->thumbnail_tiers_str != NULL && args->size > 0) {
+        char *tiers = strdup(args->thumbnail_tiers_str);
+        char *saveptr;
+        for (char *tier = strtok_r(tiers, ",", &saveptr); tier != NULL; tier = strtok_r(NULL, ",", &saveptr)) {
+            int tier_size = atoi(tier);
+            if (tier_size < 32) {
+                fprintf(stderr, "Invalid thumbnail tier size: %s\n", tier);
+                free(tiers);
+                return 1;
+            }
+            if (tier_size == args->size) {
+                continue;
+            }
+            if (args->thumbnail_tiers.count == MAX_THUMBNAIL_TIERS) {
+                fprintf(stderr, "Too many thumbnail tiers (maximum %d)\n", MAX_THUMBNAIL_TIERS);
+                free(tiers);
+                return 1;
+            }
+            args->thumbnail_tiers.sizes[args->thumbnail_tiers.count++] = tier_size;
+        }
+        free(tiers);
+    }
+
     if (args->content_size == 0) {
         args->content_size = DEFAULT_CONTENT_SIZE;
     }
@@ -131,10 +180,28 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         args->output = expandpath(args->output);
     }
 
-    int ret = mkdir(args->output, S_IRUSR | S_IWUSR | S_IXUSR);
-    if (ret != 0) {
-        fprintf(stderr, "Invalid output: '%s' (%s).\n", args->output, strerror(errno));
-        return 1;
+    if (args->in_place) {
+        if (args->incremental != NULL) {
+            fprintf(stderr, "--in-place and --incremental are mutually exclusive.\n");
+            return 1;
+        }
+
+        char descriptor_path[PATH_MAX];
+        snprintf(descriptor_path, PATH_MAX, "%sdescriptor.json", args->output);
+        if (access(descriptor_path, R_OK) != 0) {
+            fprintf(stderr, "Invalid output: '%s' is not an index (%s).\n", args->output, strerror(errno));
+            return 1;
+        }
+
+        // The index is its own original index
+        args->incremental = malloc(strlen(args->output) + 1);
+        strcpy(args->incremental, args->output);
+    } else {
+        int ret = mkdir(args->output, S_IRUSR | S_IWUSR | S_IXUSR);
+        if (ret != 0) {
+            fprintf(stderr, "Invalid output: '%s' (%s).\n", args->output, strerror(errno));
+            return 1;
+        }
     }
 
     if (args->depth <= 0) {
@@ -252,6 +319,104 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         args->max_memory_buffer = DEFAULT_MAX_MEM_BUFFER;
     }
 
+    if (args->max_spill_size == 0) {
+        args->max_spill_size = DEFAULT_MAX_SPILL_SIZE;
+    } else if (args->max_spill_size < 0) {
+        fprintf(stderr, "Invalid max-spill-size: %d\n", args->max_spill_size);
+        return 1;
+    }
+
+    if (args->spill_dir == NULL) {
+        args->spill_dir = malloc(strlen(args->output) + 1);
+        strcpy(args->spill_dir, args->output);
+    } else {
+        char *spill_dir = abspath(args->spill_dir);
+        if (spill_dir == NULL || access(spill_dir, W_OK) != 0) {
+            fprintf(stderr, "Invalid spill-dir: '%s'\n", args->spill_dir);
+            return 1;
+        }
+        args->spill_dir = spill_dir;
+    }
+
+    if (args->max_memory < 0) {
+        fprintf(stderr, "Invalid max-memory: %d\n", args->max_memory);
+        return 1;
+    }
+
+    if (args->probe_size < 0) {
+        fprintf(stderr, "Invalid probe-size: %d\n", args->probe_size);
+        return 1;
+    }
+
+    if (args->analyze_duration < 0) {
+        fprintf(stderr, "Invalid analyze-duration: %d\n", args->analyze_duration);
+        return 1;
+    }
+
+    if (args->store_growth_cap == 0) {
+        args->store_growth_cap = DEFAULT_STORE_GROWTH_CAP;
+    } else if (args->store_growth_cap < 0) {
+        fprintf(stderr, "Invalid store-growth-cap: %d\n", args->store_growth_cap);
+        return 1;
+    }
+
+    if (args->fast_output) {
+        if (args->compression_level == -1) {
+            args->compression_level = FAST_OUTPUT_COMPRESSION_LEVEL;
+        }
+        if (args->compression_threads == -1) {
+            args->compression_threads = args->threads;
+        }
+    }
+
+    if (args->compression_level == -1) {
+        args->compression_level = DEFAULT_COMPRESSION_LEVEL;
+    } else if (args->compression_level < 1 || args->compression_level > 22) {
+        fprintf(stderr, "Invalid compression-level: %d\n", args->compression_level);
+        return 1;
+    }
+
+    if (args->compression_threads == -1) {
+        args->compression_threads = 0;
+    } else if (args->compression_threads < 0) {
+        fprintf(stderr, "Invalid compression-threads: %d\n", args->compression_threads);
+        return 1;
+    }
+
+    if (args->compression_dict_samples < 0) {
+        fprintf(stderr, "Invalid compression-dict-samples: %d\n", args->compression_dict_samples);
+        return 1;
+    }
+
+    if (args->compression_frame_size == 0) {
+        // The dictionary only helps at the start of a frame: keep them small
+        if (args->compression_dict_samples > 0) {
+            args->compression_frame_size = DEFAULT_DICT_COMPRESSION_FRAME_SIZE;
+        } else {
+            args->compression_frame_size = DEFAULT_COMPRESSION_FRAME_SIZE;
+        }
+    } else if (args->compression_frame_size < 0 || args->compression_frame_size > 1024 * 1024) {
+        fprintf(stderr, "Invalid compression-frame-size: %d\n", args->compression_frame_size);
+        return 1;
+    }
+
+    if (args->index_type == NULL) {
+        args->index_type = INDEX_TYPE_NDJSON;
+    } else if (strcmp(args->index_type, INDEX_TYPE_NDJSON) != 0 && strcmp(args->index_type, INDEX_TYPE_BIN) != 0) {
+        fprintf(stderr, "Index type must be one of (%s, %s), got '%s'\n",
+                INDEX_TYPE_NDJSON, INDEX_TYPE_BIN, args->index_type);
+        return 1;
+    }
+
+    if (args->thumbnail_store == NULL) {
+        args->thumbnail_store = STORE_BACKEND_LMDB;
+    } else if (strcmp(args->thumbnail_store, STORE_BACKEND_LMDB) != 0 &&
+               strcmp(args->thumbnail_store, STORE_BACKEND_PACK) != 0) {
+        fprintf(stderr, "Thumbnail store must be one of (%s, %s), got '%s'\n",
+                STORE_BACKEND_LMDB, STORE_BACKEND_PACK, args->thumbnail_store);
+        return 1;
+    }
+
     if (args->list_path != NULL) {
         if (strcmp(args->list_path, "-") == 0) {
             args->list_file = stdin;
@@ -284,7 +449,26 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
     LOG_DEBUGF("cli.c", "arg fast_epub=%d", args->fast_epub)
     LOG_DEBUGF("cli.c", "arg treemap_threshold=%f", args->treemap_threshold)
     LOG_DEBUGF("cli.c", "arg max_memory_buffer=%d", args->max_memory_buffer)
+    LOG_DEBUGF("cli.c", "arg max_spill_size=%d", args->max_spill_size)
+    LOG_DEBUGF("cli.c", "arg spill_dir=%s", args->spill_dir)
+    LOG_DEBUGF("cli.c", "arg max_memory=%d", args->max_memory)
     LOG_DEBUGF("cli.c", "arg list_path=%s", args->list_path)
+    LOG_DEBUGF("cli.c", "arg compression_level=%d", args->compression_level)
+    LOG_DEBUGF("cli.c", "arg compression_threads=%d", args->compression_threads)
+    LOG_DEBUGF("cli.c", "arg long_distance_matching=%d", args->long_distance_matching)
+    LOG_DEBUGF("cli.c", "arg fast_output=%d", args->fast_output)
+    LOG_DEBUGF("cli.c", "arg compression_dict_samples=%d", args->compression_dict_samples)
+    LOG_DEBUGF("cli.c", "arg compression_frame_size=%d", args->compression_frame_size)
+    LOG_DEBUGF("cli.c", "arg index_type=%s", args->index_type)
+    LOG_DEBUGF("cli.c", "arg in_place=%d", args->in_place)
+    LOG_DEBUGF("cli.c", "arg store_growth_cap=%d", args->store_growth_cap)
+    LOG_DEBUGF("cli.c", "arg thumbnail_store=%s", args->thumbnail_store)
+    LOG_DEBUGF("cli.c", "arg compact_stores=%d", args->compact_stores)
+    LOG_DEBUGF("cli.c", "arg thumbnail_tiers=%s", args->thumbnail_tiers_str)
+    LOG_DEBUGF("cli.c", "arg fast_video_thumbnails=%d", args->fast_video_thumbnails)
+    LOG_DEBUGF("cli.c", "arg probe_size=%d", args->probe_size)
+    LOG_DEBUGF("cli.c", "arg analyze_duration=%d", args->analyze_duration)
+    LOG_DEBUGF("cli.c", "arg fast_probe=%d", args->fast_probe)
 
     return 0;
 }
@@ -372,10 +556,16 @@ int index_args_validate(index_args_t *args, int argc, const char **argv) {
         args->batch_size = DEFAULT_BATCH_SIZE;
     }
 
+    if (args->delta && args->force_reset) {
+        fprintf(stderr, "--delta and --force-reset are mutually exclusive.\n");
+        return 1;
+    }
+
     LOG_DEBUGF("cli.c", "arg es_url=%s", args->es_url)
     LOG_DEBUGF("cli.c", "arg es_index=%s", args->es_index)
     LOG_DEBUGF("cli.c", "arg index_path=%s", args->index_path)
     LOG_DEBUGF("cli.c", "arg script_path=%s", args->script_path)
+    LOG_DEBUGF("cli.c", "arg delta=%d", args->delta)
     LOG_DEBUGF("cli.c", "arg async_script=%s", args->async_script)
     LOG_DEBUGF("cli.c", "arg script=%s", args->script)
     LOG_DEBUGF("cli.c", "arg print=%d", args->print)
@@ -542,3 +732,20 @@ int exec_args_validate(exec_args_t *args, int argc, const char **argv) {
     LOG_DEBUGF("cli.c", "arg script=%s", args->script)
     return 0;
 }
+
+int compact_args_validate(compact_args_t *args, int argc, const char **argv) {
+
+    if (argc < 2) {
+        fprintf(stderr, "Required positional argument: PATH.\n");
+        return 1;
+    }
+
+    args->index_path = abspath(argv[1]);
+    if (args->index_path == NULL) {
+        fprintf(stderr, "File not found: %s\n", argv[1]);
+        return 1;
+    }
+
+    LOG_DEBUGF("cli.c", "arg index_path=%s", args->index_path)
+    return 0;
+}
@@ -28,11 +28,31 @@ typedef struct scan_args {
     const char* treemap_threshold_str;
     double treemap_threshold;
     int max_memory_buffer;
+    int max_spill_size;
+    char *spill_dir;
+    int max_memory;
     int read_subtitles;
+    int fast_video_thumbnails;
+    int probe_size;
+    int analyze_duration;
+    int fast_probe;
     int fast_epub;
     int calculate_checksums;
     char *list_path;
     FILE *list_file;
+    int compression_level;
+    int compression_threads;
+    int long_distance_matching;
+    int fast_output;
+    int compression_dict_samples;
+    int compression_frame_size;
+    char *index_type;
+    int in_place;
+    int store_growth_cap;
+    char *thumbnail_store;
+    int compact_stores;
+    char *thumbnail_tiers_str;
+    thumbnail_tiers_t thumbnail_tiers;
 } scan_args_t;
 
 scan_args_t *scan_args_create();
@@ -56,6 +76,7 @@ typedef struct index_args {
     int async_script;
     int force_reset;
     int threads;
+    int delta;
 } index_args_t;
 
 typedef struct web_args {
@@ -75,6 +96,10 @@ typedef struct web_args {
     const char **indices;
 } web_args_t;
 
+typedef struct compact_args {
+    char *index_path;
+} compact_args_t;
+
 typedef struct exec_args {
     char *es_url;
     char *es_index;
@@ -102,4 +127,10 @@ void exec_args_destroy(exec_args_t *args);
 
 int exec_args_validate(exec_args_t *args, int argc, const char **argv);
 
+compact_args_t *compact_args_create();
+
+void compact_args_destroy(compact_args_t *args);
+
+int compact_args_validate(compact_args_t *args, int argc, const char **argv);
+
 #endif
@@ -17,6 +17,10 @@
 #include "libscan/wpd/wpd.h"
 #include "libscan/json/json.h"
 #include "src/io/store.h"
+#include "src/io/manifest.h"
+#include "src/io/changes.h"
+#include "src/inc_table.h"
+#include "src/parsing/mem_budget.h"
 #include "src/index/elastic.h"
 
 #include <glib.h>
@@ -39,14 +43,22 @@ typedef struct {
     size_t stat_tn_size;
     size_t stat_index_size;
 
-    GHashTable *original_table;
-    GHashTable *copy_table;
-    pthread_mutex_t copy_table_mu;
+    int compression_dict_samples;
+
+    // In-place incremental scan, documents are written to a delta index file
+    int in_place;
+    int generation;
+
+    inc_table_t *original_table;
+    // Thumbnail tiers of the original index of an incremental scan
+    thumbnail_tiers_t original_tiers;
 
     pcre *exclude;
     pcre_extra *exclude_extra;
     int fast;
 
+    mem_budget_t mem_budget;
+
     GHashTable *dbg_current_files;
     pthread_mutex_t dbg_current_files_mu;
 
@@ -81,10 +93,9 @@ typedef struct {
     char *es_index;
     int batch_size;
     tpool_t *pool;
+    // NULL if the store is empty
     store_t *tag_store;
-    GHashTable *tags;
     store_t *meta_store;
-    GHashTable *meta;
 } IndexCtx_t;
 
 typedef struct {
@@ -0,0 +1,115 @@
+#include "inc_table.h"
+#include "sist.h"
+
+// Grow when the table is 3/4 full
+#define INC_TABLE_MAX_LOAD_NUM 3
+#define INC_TABLE_MAX_LOAD_DEN 4
+#define INC_TABLE_MIN_SIZE 1024
+
+static size_t inc_table_size_for(size_t count) {
+    size_t size = INC_TABLE_MIN_SIZE;
+    while (size * INC_TABLE_MAX_LOAD_NUM / INC_TABLE_MAX_LOAD_DEN <= count) {
+        size *= 2;
+    }
+    return size;
+}
+
+inc_table_t *inc_table_create(size_t expected_count) {
+    inc_table_t *table = malloc(sizeof(inc_table_t));
+
+    size_t size = inc_table_size_for(expected_count);
+    table->entries = calloc(size, sizeof(inc_table_entry_t));
+    table->mask = size - 1;
+    table->count = 0;
+
+    return table;
+}
+
+void inc_table_destroy(inc_table_t *table) {
+    free(table->entries);
+    free(table);
+}
+
+/**
+ * md5 digests are uniformly distributed: the first 8 bytes are a good enough hash
+ */
+__always_inline
+static size_t inc_table_hash(const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    size_t hash;
+    memcpy(&hash, path_md5, sizeof(hash));
+    return hash;
+}
+
+static inc_table_entry_t *inc_table_find(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    size_t i = inc_table_hash(path_md5) & table->mask;
+
+    while (TRUE) {
+        inc_table_entry_t *entry = &table->entries[i];
+
+        if (md5_digest_is_null(entry->path_md5) || memcmp(entry->path_md5, path_md5, MD5_DIGEST_LENGTH) == 0) {
+            return entry;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+static void inc_table_grow(inc_table_t *table) {
+    inc_table_entry_t *old_entries = table->entries;
+    size_t old_size = table->mask + 1;
+
+    table->entries = calloc(old_size * 2, sizeof(inc_table_entry_t));
+    table->mask = old_size * 2 - 1;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (!md5_digest_is_null(old_entries[i].path_md5)) {
+            *inc_table_find(table, old_entries[i].path_md5) = old_entries[i];
+        }
+    }
+
+    free(old_entries);
+}
+
+void inc_table_put(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH], int mtime, int flags) {
+
+    if ((table->count + 1) * INC_TABLE_MAX_LOAD_DEN > (table->mask + 1) * INC_TABLE_MAX_LOAD_NUM) {
+        inc_table_grow(table);
+    }
+
+    inc_table_entry_t *entry = inc_table_find(table, path_md5);
+    if (md5_digest_is_null(entry->path_md5)) {
+        memcpy(entry->path_md5, path_md5, MD5_DIGEST_LENGTH);
+        table->count += 1;
+    }
+    entry->mtime = mtime;
+    entry->flags = flags;
+}
+
+int inc_table_get(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    if (table == NULL || md5_digest_is_null(path_md5)) {
+        return 0;
+    }
+    return inc_table_find(table, path_md5)->mtime;
+}
+
+void inc_table_mark(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH], int flag) {
+    inc_table_entry_t *entry = inc_table_find(table, path_md5);
+
+    if (!md5_digest_is_null(entry->path_md5)) {
+        __atomic_fetch_or(&entry->flags, flag, __ATOMIC_RELAXED);
+    }
+}
+
+void inc_table_mark_for_copy(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    inc_table_mark(table, path_md5, INC_TABLE_FLAG_COPY);
+}
+
+int inc_table_is_marked(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH], int flag) {
+    if (table == NULL || md5_digest_is_null(path_md5)) {
+        return FALSE;
+    }
+    return (__atomic_load_n(&inc_table_find(table, path_md5)->flags, __ATOMIC_RELAXED) & flag) != 0;
+}
+
+int inc_table_is_marked_for_copy(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    return inc_table_is_marked(table, path_md5, INC_TABLE_FLAG_COPY);
+}
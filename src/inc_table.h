@@ -0,0 +1,60 @@
+#ifndef SIST2_INC_TABLE_H
+#define SIST2_INC_TABLE_H
+
+#include <stddef.h>
+#include <openssl/md5.h>
+
+#define INC_TABLE_FLAG_COPY 1
+// The document is inside an archive (or another document)
+#define INC_TABLE_FLAG_PARENT 2
+// A new version of the document was written (in-place scans)
+#define INC_TABLE_FLAG_REWRITTEN 4
+// The file was not parsed in the original index, it is parsed even if it was not modified
+#define INC_TABLE_FLAG_DEFERRED 8
+
+/*
+ * Open-addressing (linear probing) table of the documents of the
+ * original index of an incremental scan, keyed by path md5.
+ * Slots with a null md5 are empty.
+ */
+typedef struct {
+    unsigned char path_md5[MD5_DIGEST_LENGTH];
+    int mtime;
+    int flags;
+} inc_table_entry_t;
+
+typedef struct {
+    inc_table_entry_t *entries;
+    size_t mask;
+    size_t count;
+} inc_table_t;
+
+inc_table_t *inc_table_create(size_t expected_count);
+
+void inc_table_destroy(inc_table_t *table);
+
+/**
+ * Not thread safe!
+ */
+void inc_table_put(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH], int mtime, int flags);
+
+/**
+ * Lock-free, must not be called concurrently with inc_table_put()
+ *
+ * @return mtime of the document or 0 if it is not in the table
+ */
+int inc_table_get(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]);
+
+/**
+ * Set a flag of an existing entry. Lock-free, must not be called
+ * concurrently with inc_table_put()
+ */
+void inc_table_mark(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH], int flag);
+
+int inc_table_is_marked(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH], int flag);
+
+void inc_table_mark_for_copy(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]);
+
+int inc_table_is_marked_for_copy(inc_table_t *table, const unsigned char path_md5[MD5_DIGEST_LENGTH]);
+
+#endif
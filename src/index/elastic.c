@@ -61,12 +61,29 @@ void index_json(cJSON *document, const char index_id_str[MD5_STR_LENGTH]) {
     memcpy(bulk_line->path_md5_str, index_id_str, MD5_STR_LENGTH);
     *(bulk_line->line + json_len) = '\n';
     *(bulk_line->line + json_len + 1) = '\0';
+    bulk_line->type = ES_BULK_LINE_INDEX;
     bulk_line->next = NULL;
 
     cJSON_free(json);
     tpool_add_work(IndexCtx.pool, index_json_func, bulk_line);
 }
 
+void print_delete_json(const char index_id_str[MD5_STR_LENGTH]) {
+    printf("{\"delete\":{\"_id\":\"%s\",\"_index\":\"%s\",\"_type\":\"_doc\"}}\n",
+           index_id_str, IndexCtx.es_index);
+}
+
+void delete_json(const char index_id_str[MD5_STR_LENGTH]) {
+    // Delete actions have no source line
+    es_bulk_line_t *bulk_line = malloc(sizeof(es_bulk_line_t) + 1);
+    memcpy(bulk_line->path_md5_str, index_id_str, MD5_STR_LENGTH);
+    *bulk_line->line = '\0';
+    bulk_line->type = ES_BULK_LINE_DELETE;
+    bulk_line->next = NULL;
+
+    tpool_add_work(IndexCtx.pool, index_json_func, bulk_line);
+}
+
 void execute_update_script(const char *script, int async, const char index_id[MD5_STR_LENGTH]) {
 
     if (Indexer == NULL) {
@@ -130,8 +147,8 @@ void *create_bulk_buffer(int max, int *count, size_t *buf_len) {
         char action_str[256];
         snprintf(
                 action_str, sizeof(action_str),
-                "{\"index\":{\"_id\":\"%s\",\"_type\":\"_doc\",\"_index\":\"%s\"}}\n",
-                line->path_md5_str, Indexer->es_index
+                "{\"%s\":{\"_id\":\"%s\",\"_type\":\"_doc\",\"_index\":\"%s\"}}\n",
+                line->type == ES_BULK_LINE_DELETE ? "delete" : "index", line->path_md5_str, Indexer->es_index
         );
 
         size_t action_str_len = strlen(action_str);
@@ -172,7 +189,12 @@ void print_errors(response_t *r) {
     if (cJSON_GetObjectItem(ret_json, "errors")->valueint != 0) {
         cJSON *err;
         cJSON_ArrayForEach(err, cJSON_GetObjectItem(ret_json, "items")) {
-            if (cJSON_GetObjectItem(cJSON_GetObjectItem(err, "index"), "status")->valueint != 201) {
+            // Item of an index or delete action
+            cJSON *action = err->child;
+            int status = cJSON_GetObjectItem(action, "status")->valueint;
+
+            // 200: the document was replaced or deleted, 404: the deleted document was not indexed
+            if (status != 201 && status != 200 && !(status == 404 && strcmp(action->string, "delete") == 0)) {
                 char *str = cJSON_Print(err);
                 LOG_ERRORF("elastic.c", "%s\n", str);
                 cJSON_free(str);
@@ -3,9 +3,13 @@
 
 #include "src/sist.h"
 
+#define ES_BULK_LINE_INDEX 0
+#define ES_BULK_LINE_DELETE 1
+
 typedef struct es_bulk_line {
     struct es_bulk_line *next;
     char path_md5_str[MD5_STR_LENGTH];
+    int type;
     char line[0];
 } es_bulk_line_t;
 
@@ -40,6 +44,13 @@ void print_json(cJSON *document, const char index_id_str[MD5_STR_LENGTH]);
 
 void index_json(cJSON *document, const char index_id_str[MD5_STR_LENGTH]);
 
+void print_delete_json(const char index_id_str[MD5_STR_LENGTH]);
+
+/**
+ * Queue a bulk delete action for the document
+ */
+void delete_json(const char index_id_str[MD5_STR_LENGTH]);
+
 es_indexer_t *create_indexer(const char *url, const char *index);
 
 void elastic_cleanup();
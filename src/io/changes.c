@@ -0,0 +1,118 @@
+#include "changes.h"
+#include "src/ctx.h"
+
+static FILE *ChangesFile = NULL;
+static uint64_t ChangesCount[CHANGE_DELETED + 1];
+
+#define CHANGES_TMP_FILENAME CHANGES_FILENAME ".tmp"
+
+static void changes_open_writer(const char *index_path) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s" CHANGES_TMP_FILENAME, index_path);
+
+    ChangesFile = fopen(path, "wb");
+    if (ChangesFile == NULL) {
+        LOG_FATALF("changes.c", "Could not open %s for writing: %s", path, strerror(errno))
+    }
+
+    // The header is written by changes_write()
+    changes_header_t header = {0};
+    fwrite(&header, sizeof(header), 1, ChangesFile);
+    memset(ChangesCount, 0, sizeof(ChangesCount));
+}
+
+void changes_add(const unsigned char path_md5[MD5_DIGEST_LENGTH], int status) {
+
+    if (ChangesFile == NULL) {
+        changes_open_writer(ScanCtx.index.path);
+    }
+
+    changes_entry_t entry;
+    memcpy(entry.path_md5, path_md5, MD5_DIGEST_LENGTH);
+    entry.status = htole32(status);
+
+    fwrite(&entry, sizeof(entry), 1, ChangesFile);
+    ChangesCount[status] += 1;
+}
+
+void changes_write(const char *index_path, int generation, uint64_t unchanged_count) {
+
+    if (ChangesFile == NULL) {
+        // No changes
+        changes_open_writer(index_path);
+    }
+
+    changes_header_t header;
+    memcpy(header.magic, CHANGES_MAGIC, sizeof(header.magic));
+    header.version = htole32(CHANGES_VERSION);
+    header.generation = (int32_t) htole32(generation);
+    header.new_count = htole64(ChangesCount[CHANGE_NEW]);
+    header.modified_count = htole64(ChangesCount[CHANGE_MODIFIED]);
+    header.unchanged_count = htole64(unchanged_count);
+    header.deleted_count = htole64(ChangesCount[CHANGE_DELETED]);
+
+    fseek(ChangesFile, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, ChangesFile);
+    fclose(ChangesFile);
+    ChangesFile = NULL;
+
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s" CHANGES_TMP_FILENAME, index_path);
+    snprintf(path, PATH_MAX, "%s" CHANGES_FILENAME, index_path);
+    if (rename(tmp_path, path) != 0) {
+        LOG_FATALF("changes.c", "Could not rename %s: %s", tmp_path, strerror(errno))
+    }
+
+    LOG_INFOF("changes.c", "Incremental scan: %lu new, %lu modified, %lu unchanged, %lu deleted documents",
+              ChangesCount[CHANGE_NEW], ChangesCount[CHANGE_MODIFIED], unchanged_count,
+              ChangesCount[CHANGE_DELETED])
+}
+
+changes_t *changes_read(const char *index_path) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s" CHANGES_FILENAME, index_path);
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    changes_t *changes = malloc(sizeof(changes_t));
+    if (fread(&changes->header, sizeof(changes_header_t), 1, file) != 1 ||
+        memcmp(changes->header.magic, CHANGES_MAGIC, sizeof(changes->header.magic)) != 0 ||
+        le32toh(changes->header.version) != CHANGES_VERSION) {
+        LOG_WARNINGF("changes.c", "Ignoring invalid changes file %s", path)
+        free(changes);
+        fclose(file);
+        return NULL;
+    }
+
+    changes->header.generation = (int32_t) le32toh(changes->header.generation);
+    changes->header.new_count = le64toh(changes->header.new_count);
+    changes->header.modified_count = le64toh(changes->header.modified_count);
+    changes->header.unchanged_count = le64toh(changes->header.unchanged_count);
+    changes->header.deleted_count = le64toh(changes->header.deleted_count);
+
+    changes->count = changes->header.new_count + changes->header.modified_count + changes->header.deleted_count;
+    changes->entries = malloc(sizeof(changes_entry_t) * MAX(changes->count, 1));
+
+    if (fread(changes->entries, sizeof(changes_entry_t), changes->count, file) != changes->count) {
+        LOG_WARNINGF("changes.c", "Ignoring truncated changes file %s", path)
+        changes_destroy(changes);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    for (size_t i = 0; i < changes->count; i++) {
+        changes->entries[i].status = le32toh(changes->entries[i].status);
+    }
+
+    return changes;
+}
+
+void changes_destroy(changes_t *changes) {
+    free(changes->entries);
+    free(changes);
+}
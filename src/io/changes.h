@@ -0,0 +1,62 @@
+#ifndef SIST2_CHANGES_H
+#define SIST2_CHANGES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <endian.h>
+#include <openssl/md5.h>
+
+#define CHANGES_FILENAME "changes.bin"
+#define CHANGES_MAGIC "SIST2CHG"
+#define CHANGES_VERSION 1
+
+#define CHANGE_NEW 1
+#define CHANGE_MODIFIED 2
+#define CHANGE_DELETED 3
+
+/*
+ * changes.bin: documents that were added, modified or deleted by the last
+ * incremental scan of the index. Unchanged documents are only counted.
+ * All integers are little endian.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    // Generation of the index files with the new and modified documents
+    int32_t generation;
+    uint64_t new_count;
+    uint64_t modified_count;
+    uint64_t unchanged_count;
+    uint64_t deleted_count;
+} changes_header_t;
+
+typedef struct {
+    unsigned char path_md5[MD5_DIGEST_LENGTH];
+    uint32_t status;
+} changes_entry_t;
+
+typedef struct {
+    changes_header_t header;
+    changes_entry_t *entries;
+    size_t count;
+} changes_t;
+
+/**
+ * Not thread safe!
+ */
+void changes_add(const unsigned char path_md5[MD5_DIGEST_LENGTH], int status);
+
+/**
+ * Finalize <index_path>changes.bin
+ */
+void changes_write(const char *index_path, int generation, uint64_t unchanged_count);
+
+/**
+ * @return NULL if the index has no (valid) changes file
+ */
+changes_t *changes_read(const char *index_path);
+
+void changes_destroy(changes_t *changes);
+
+#endif
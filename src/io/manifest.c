@@ -0,0 +1,168 @@
+#include "manifest.h"
+#include "src/ctx.h"
+
+#include <sys/mman.h>
+
+static FILE *ManifestFile = NULL;
+static uint64_t ManifestCount = 0;
+
+// The previous manifest of the index stays readable until manifest_write()
+#define MANIFEST_TMP_FILENAME MANIFEST_FILENAME ".tmp"
+
+static void manifest_open_writer(const char *index_path) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s" MANIFEST_TMP_FILENAME, index_path);
+
+    ManifestFile = fopen(path, "w+b");
+    if (ManifestFile == NULL) {
+        LOG_FATALF("manifest.c", "Could not open %s for writing: %s", path, strerror(errno))
+    }
+
+    // The header is written by manifest_write(), an incomplete file has no magic
+    manifest_header_t header = {0};
+    fwrite(&header, sizeof(header), 1, ManifestFile);
+}
+
+void manifest_add(const unsigned char path_md5[MD5_DIGEST_LENGTH], int mtime, uint64_t size, uint32_t flags) {
+
+    if (ManifestFile == NULL) {
+        manifest_open_writer(ScanCtx.index.path);
+    }
+
+    manifest_entry_t entry;
+    memcpy(entry.path_md5, path_md5, MD5_DIGEST_LENGTH);
+    entry.mtime = (int32_t) htole32(mtime);
+    entry.flags = htole32(flags);
+    entry.size = htole64(size);
+
+    fwrite(&entry, sizeof(entry), 1, ManifestFile);
+    ManifestCount += 1;
+}
+
+static int manifest_entry_cmp(const void *a, const void *b) {
+    return memcmp(((manifest_entry_t *) a)->path_md5, ((manifest_entry_t *) b)->path_md5, MD5_DIGEST_LENGTH);
+}
+
+void manifest_write(const char *index_path) {
+
+    if (ManifestFile == NULL) {
+        // Empty index
+        manifest_open_writer(index_path);
+    }
+
+    fflush(ManifestFile);
+
+    // Sort the entries in place, the file can be larger than the available memory
+    size_t map_size = sizeof(manifest_header_t) + ManifestCount * sizeof(manifest_entry_t);
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(ManifestFile), 0);
+    if (map == MAP_FAILED) {
+        LOG_FATALF("manifest.c", "Could not mmap manifest of %s: %s", index_path, strerror(errno))
+    }
+
+    qsort((char *) map + sizeof(manifest_header_t), ManifestCount, sizeof(manifest_entry_t), manifest_entry_cmp);
+
+    manifest_header_t *header = map;
+    header->version = htole32(MANIFEST_VERSION);
+    header->entry_size = htole32(sizeof(manifest_entry_t));
+    header->count = htole64(ManifestCount);
+    memcpy(header->magic, MANIFEST_MAGIC, sizeof(header->magic));
+
+    msync(map, map_size, MS_SYNC);
+    munmap(map, map_size);
+    fclose(ManifestFile);
+
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s" MANIFEST_TMP_FILENAME, index_path);
+    snprintf(path, PATH_MAX, "%s" MANIFEST_FILENAME, index_path);
+    if (rename(tmp_path, path) != 0) {
+        LOG_FATALF("manifest.c", "Could not rename %s: %s", tmp_path, strerror(errno))
+    }
+
+    LOG_DEBUGF("manifest.c", "Wrote %lu entries to %s" MANIFEST_FILENAME, ManifestCount, index_path)
+
+    ManifestFile = NULL;
+    ManifestCount = 0;
+}
+
+manifest_t *manifest_open(const char *index_path) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s" MANIFEST_FILENAME, index_path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+
+    if (info.st_size < sizeof(manifest_header_t)) {
+        LOG_WARNINGF("manifest.c", "Ignoring invalid manifest %s", path)
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_WARNINGF("manifest.c", "Could not mmap %s: %s", path, strerror(errno))
+        return NULL;
+    }
+
+    const manifest_header_t *header = map;
+    uint64_t count = le64toh(header->count);
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0 ||
+        le32toh(header->version) != MANIFEST_VERSION ||
+        le32toh(header->entry_size) != sizeof(manifest_entry_t) ||
+        info.st_size != sizeof(manifest_header_t) + count * sizeof(manifest_entry_t)) {
+        LOG_WARNINGF("manifest.c", "Ignoring invalid manifest %s", path)
+        munmap(map, info.st_size);
+        return NULL;
+    }
+
+    // Lookups are random
+    madvise(map, info.st_size, MADV_RANDOM);
+
+    manifest_t *manifest = malloc(sizeof(manifest_t));
+    manifest->map = map;
+    manifest->map_size = info.st_size;
+    manifest->entries = (manifest_entry_t *) ((char *) map + sizeof(manifest_header_t));
+    manifest->count = count;
+
+    return manifest;
+}
+
+const manifest_entry_t *manifest_get(const manifest_t *manifest, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+
+    size_t lo = 0;
+    size_t hi = manifest->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(manifest->entries[mid].path_md5, path_md5, MD5_DIGEST_LENGTH);
+
+        if (cmp == 0) {
+            return &manifest->entries[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+int manifest_get_mtime(const manifest_t *manifest, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    const manifest_entry_t *entry = manifest_get(manifest, path_md5);
+    if (entry == NULL) {
+        return 0;
+    }
+    return (int) le32toh(entry->mtime);
+}
+
+void manifest_close(manifest_t *manifest) {
+    munmap(manifest->map, manifest->map_size);
+    free(manifest);
+}
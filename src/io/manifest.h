@@ -0,0 +1,70 @@
+#ifndef SIST2_MANIFEST_H
+#define SIST2_MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <endian.h>
+#include <openssl/md5.h>
+
+#define MANIFEST_FILENAME "manifest.bin"
+#define MANIFEST_MAGIC "SIST2MNF"
+#define MANIFEST_VERSION 1
+
+// The document is inside an archive (or another document)
+#define MANIFEST_FLAG_PARENT 1
+// The file was not parsed (see --max-memory), incremental scans parse it again
+#define MANIFEST_FLAG_DEFERRED 2
+
+/*
+ * manifest.bin: one fixed-size entry per document of the index, sorted
+ * by path md5 so that it can be searched directly once mmapped.
+ * All integers are little endian.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+} manifest_header_t;
+
+typedef struct {
+    unsigned char path_md5[MD5_DIGEST_LENGTH];
+    int32_t mtime;
+    uint32_t flags;
+    uint64_t size;
+} manifest_entry_t;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    const manifest_entry_t *entries;
+    size_t count;
+} manifest_t;
+
+/**
+ * Not thread safe!
+ */
+void manifest_add(const unsigned char path_md5[MD5_DIGEST_LENGTH], int mtime, uint64_t size, uint32_t flags);
+
+/**
+ * Sort the entries added with manifest_add() and finalize
+ * <index_path>manifest.bin
+ */
+void manifest_write(const char *index_path);
+
+/**
+ * @return NULL if the index has no (valid) manifest
+ */
+manifest_t *manifest_open(const char *index_path);
+
+const manifest_entry_t *manifest_get(const manifest_t *manifest, const unsigned char path_md5[MD5_DIGEST_LENGTH]);
+
+/**
+ * @return mtime of the document or 0 if it is not in the manifest
+ */
+int manifest_get_mtime(const manifest_t *manifest, const unsigned char path_md5[MD5_DIGEST_LENGTH]);
+
+void manifest_close(manifest_t *manifest);
+
+#endif
@@ -0,0 +1,570 @@
+#include "pack_store.h"
+#include "src/ctx.h"
+
+#include <endian.h>
+
+// Length of a deleted entry
+#define PACK_DELETED UINT32_MAX
+
+typedef struct {
+    pthread_mutex_t mu;
+
+    // Entries of pack.index, sorted by key
+    pack_index_entry_t *entries;
+    size_t count;
+
+    // Entries written since the store was opened, in write order
+    pack_index_entry_t *new_entries;
+    size_t new_count;
+    size_t new_capacity;
+
+    int segment_fds[PACK_MAX_SEGMENTS];
+    int write_segment;
+    uint64_t write_offset;
+    int dirty;
+
+    // Buffer of pack_store_read_begin()
+    char *read_buf;
+    size_t read_buf_size;
+} pack_store_t;
+
+static const store_ops_t PackStoreOps;
+
+#define PACK(store) ((pack_store_t *) (store)->backend)
+
+int pack_store_exists(const char *path) {
+    char index_path[PATH_MAX];
+    snprintf(index_path, PATH_MAX, "%s/" PACK_INDEX_FILENAME, path);
+    return access(index_path, F_OK) == 0;
+}
+
+static int pack_entry_cmp(const void *a, const void *b) {
+    return memcmp(((pack_index_entry_t *) a)->key, ((pack_index_entry_t *) b)->key, MD5_DIGEST_LENGTH);
+}
+
+/**
+ * Entries with the same key are sorted in write order
+ */
+static int pack_new_entry_cmp(const void *a, const void *b) {
+    const pack_index_entry_t *entry_a = a;
+    const pack_index_entry_t *entry_b = b;
+
+    int cmp = memcmp(entry_a->key, entry_b->key, MD5_DIGEST_LENGTH);
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (entry_a->segment != entry_b->segment) {
+        return entry_a->segment < entry_b->segment ? -1 : 1;
+    }
+    return entry_a->offset < entry_b->offset ? -1 : (entry_a->offset > entry_b->offset);
+}
+
+/**
+ * Must be called with the lock held
+ */
+static int pack_segment_fd(store_t *store, int segment) {
+    pack_store_t *pack = PACK(store);
+
+    if (pack->segment_fds[segment] == -1) {
+        char segment_path[PATH_MAX];
+        snprintf(segment_path, PATH_MAX, "%s/" PACK_SEGMENT_FILENAME_FORMAT, store->path, segment);
+
+        pack->segment_fds[segment] = open(segment_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        if (pack->segment_fds[segment] == -1) {
+            LOG_FATALF("pack_store.c", "Could not open %s: %s", segment_path, strerror(errno))
+        }
+    }
+    return pack->segment_fds[segment];
+}
+
+static void pack_read_index(store_t *store) {
+    pack_store_t *pack = PACK(store);
+
+    char index_path[PATH_MAX];
+    snprintf(index_path, PATH_MAX, "%s/" PACK_INDEX_FILENAME, store->path);
+
+    FILE *file = fopen(index_path, "rb");
+    if (file == NULL) {
+        return;
+    }
+
+    pack_index_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, PACK_MAGIC, sizeof(header.magic)) != 0 ||
+        le32toh(header.version) != PACK_VERSION ||
+        le32toh(header.entry_size) != sizeof(pack_index_entry_t)) {
+        LOG_FATALF("pack_store.c", "Invalid pack index %s", index_path)
+    }
+
+    pack->count = le64toh(header.count);
+    pack->entries = malloc(sizeof(pack_index_entry_t) * MAX(pack->count, 1));
+    if (fread(pack->entries, sizeof(pack_index_entry_t), pack->count, file) != pack->count) {
+        LOG_FATALF("pack_store.c", "Truncated pack index %s", index_path)
+    }
+    fclose(file);
+
+    // Entries that point outside of the segments are dropped
+    size_t count = 0;
+    for (size_t i = 0; i < pack->count; i++) {
+        pack_index_entry_t entry = pack->entries[i];
+        entry.segment = le32toh(entry.segment);
+        entry.length = le32toh(entry.length);
+        entry.offset = le64toh(entry.offset);
+
+        if (entry.segment >= PACK_MAX_SEGMENTS) {
+            continue;
+        }
+        pack->entries[count++] = entry;
+    }
+
+    if (count != pack->count) {
+        LOG_ERRORF("pack_store.c", "Ignored %zu invalid entries of pack index %s", pack->count - count, index_path)
+        pack->count = count;
+    }
+}
+
+store_t *pack_store_create(const char *path) {
+    store_t *store = calloc(sizeof(struct store_t), 1);
+    mkdir(path, S_IWUSR | S_IRUSR | S_IXUSR);
+    strcpy(store->path, path);
+    store->ops = &PackStoreOps;
+
+    pack_store_t *pack = calloc(sizeof(pack_store_t), 1);
+    store->backend = pack;
+    pthread_mutex_init(&pack->mu, NULL);
+    for (int i = 0; i < PACK_MAX_SEGMENTS; i++) {
+        pack->segment_fds[i] = -1;
+    }
+
+    pack_read_index(store);
+
+    // Continue appending to the last segment
+    pack->write_segment = 0;
+    while (pack->write_segment + 1 < PACK_MAX_SEGMENTS) {
+        char segment_path[PATH_MAX];
+        snprintf(segment_path, PATH_MAX, "%s/" PACK_SEGMENT_FILENAME_FORMAT, store->path, pack->write_segment + 1);
+        if (access(segment_path, F_OK) != 0) {
+            break;
+        }
+        pack->write_segment += 1;
+    }
+
+    struct stat info;
+    fstat(pack_segment_fd(store, pack->write_segment), &info);
+    pack->write_offset = info.st_size;
+
+    LOG_DEBUGF("pack_store.c", "Opened pack store %s (%zu entries, %d segments)",
+               path, pack->count, pack->write_segment + 1)
+    return store;
+}
+
+/**
+ * Must be called with the lock held
+ *
+ * @return NULL if the key is not in the store
+ */
+static const pack_index_entry_t *pack_find(pack_store_t *pack, const char *key) {
+
+    // The entries written since the store was opened replace the older ones
+    for (size_t i = pack->new_count; i > 0; i--) {
+        if (memcmp(pack->new_entries[i - 1].key, key, MD5_DIGEST_LENGTH) == 0) {
+            return pack->new_entries[i - 1].length == PACK_DELETED ? NULL : &pack->new_entries[i - 1];
+        }
+    }
+
+    if (pack->count == 0) {
+        return NULL;
+    }
+
+    pack_index_entry_t needle;
+    memcpy(needle.key, key, MD5_DIGEST_LENGTH);
+    const pack_index_entry_t *entry = bsearch(&needle, pack->entries, pack->count, sizeof(pack_index_entry_t),
+                                              pack_entry_cmp);
+
+    if (entry == NULL || entry->length == PACK_DELETED) {
+        return NULL;
+    }
+    return entry;
+}
+
+static void pack_store_write(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len) {
+    pack_store_t *pack = PACK(store);
+
+    if (key_len != MD5_DIGEST_LENGTH) {
+        LOG_FATALF("pack_store.c", "Invalid key length for pack store %s: %zu", store->path, key_len)
+    }
+
+    // Reserve the space, the value is written without the lock
+    pthread_mutex_lock(&pack->mu);
+
+    if (pack->write_offset > 0 && pack->write_offset + buf_len > PACK_SEGMENT_SIZE) {
+        pack->write_segment += 1;
+        pack->write_offset = 0;
+        if (pack->write_segment == PACK_MAX_SEGMENTS) {
+            LOG_FATALF("pack_store.c", "Too many segments in pack store %s", store->path)
+        }
+    }
+
+    int fd = pack_segment_fd(store, pack->write_segment);
+    uint64_t offset = pack->write_offset;
+    pack->write_offset += buf_len;
+
+    if (pack->new_count == pack->new_capacity) {
+        pack->new_capacity = MAX(pack->new_capacity * 2, 1024);
+        pack->new_entries = realloc(pack->new_entries, sizeof(pack_index_entry_t) * pack->new_capacity);
+    }
+
+    pack_index_entry_t *entry = &pack->new_entries[pack->new_count++];
+    memcpy(entry->key, key, MD5_DIGEST_LENGTH);
+    entry->segment = pack->write_segment;
+    entry->offset = offset;
+    entry->length = buf_len;
+    pack->dirty = TRUE;
+
+    pthread_mutex_unlock(&pack->mu);
+
+    if (pwrite(fd, buf, buf_len, (off_t) offset) != (ssize_t) buf_len) {
+        LOG_FATALF("pack_store.c", "Could not write to pack store %s: %s", store->path, strerror(errno))
+    }
+
+    __atomic_fetch_add(&ScanCtx.stat_tn_size, buf_len, __ATOMIC_RELAXED);
+}
+
+static void pack_store_flush(store_t *store) {
+    pack_store_t *pack = PACK(store);
+
+    pthread_mutex_lock(&pack->mu);
+    fsync(pack_segment_fd(store, pack->write_segment));
+    pthread_mutex_unlock(&pack->mu);
+}
+
+/**
+ * @return FALSE if the key is not in the store
+ */
+static int pack_store_locate(store_t *store, const char *key, size_t key_len, int *fd, pack_index_entry_t *entry) {
+    pack_store_t *pack = PACK(store);
+
+    if (key_len != MD5_DIGEST_LENGTH) {
+        return FALSE;
+    }
+
+    pthread_mutex_lock(&pack->mu);
+    const pack_index_entry_t *found = pack_find(pack, key);
+    if (found != NULL) {
+        *entry = *found;
+        *fd = pack_segment_fd(store, (int) found->segment);
+    }
+    pthread_mutex_unlock(&pack->mu);
+
+    return found != NULL;
+}
+
+static char *pack_store_read(store_t *store, char *key, size_t key_len, size_t *ret_vallen) {
+    *ret_vallen = 0;
+
+    int fd;
+    pack_index_entry_t entry;
+    if (!pack_store_locate(store, key, key_len, &fd, &entry)) {
+        return NULL;
+    }
+
+    char *buf = malloc(MAX(entry.length, 1));
+    if (pread(fd, buf, entry.length, (off_t) entry.offset) != (ssize_t) entry.length) {
+        LOG_ERRORF("pack_store.c", "Could not read from pack store %s: %s", store->path, strerror(errno))
+        free(buf);
+        return NULL;
+    }
+
+    *ret_vallen = entry.length;
+    return buf;
+}
+
+static const char *pack_store_read_begin(store_t *store, const char *key, size_t key_len, size_t *ret_vallen) {
+    pack_store_t *pack = PACK(store);
+    *ret_vallen = 0;
+
+    int fd;
+    pack_index_entry_t entry;
+    if (!pack_store_locate(store, key, key_len, &fd, &entry)) {
+        return NULL;
+    }
+
+    if (entry.length > pack->read_buf_size) {
+        pack->read_buf_size = entry.length;
+        pack->read_buf = realloc(pack->read_buf, pack->read_buf_size);
+    }
+
+    if (pread(fd, pack->read_buf, entry.length, (off_t) entry.offset) != (ssize_t) entry.length) {
+        LOG_ERRORF("pack_store.c", "Could not read from pack store %s: %s", store->path, strerror(errno))
+        return NULL;
+    }
+
+    *ret_vallen = entry.length;
+    return pack->read_buf;
+}
+
+static void pack_store_read_end(UNUSED(store_t *store)) {
+}
+
+/**
+ * Merge the sorted index with the new entries, drop the deleted and
+ * replaced entries.
+ *
+ * @return number of live entries written to pack->entries
+ */
+static size_t pack_merge_entries(pack_store_t *pack) {
+    qsort(pack->new_entries, pack->new_count, sizeof(pack_index_entry_t), pack_new_entry_cmp);
+
+    pack_index_entry_t *merged = malloc(sizeof(pack_index_entry_t) * MAX(pack->count + pack->new_count, 1));
+    size_t merged_count = 0;
+
+    size_t i = 0;
+    size_t j = 0;
+    while (i < pack->count || j < pack->new_count) {
+        const pack_index_entry_t *entry;
+
+        if (j == pack->new_count ||
+            (i < pack->count && pack_entry_cmp(&pack->entries[i], &pack->new_entries[j]) < 0)) {
+            entry = &pack->entries[i++];
+        } else {
+            // Skip the older versions of the key
+            while (i < pack->count && pack_entry_cmp(&pack->entries[i], &pack->new_entries[j]) == 0) {
+                i++;
+            }
+            while (j + 1 < pack->new_count && pack_entry_cmp(&pack->new_entries[j], &pack->new_entries[j + 1]) == 0) {
+                j++;
+            }
+            entry = &pack->new_entries[j++];
+        }
+
+        if (entry->length != PACK_DELETED) {
+            merged[merged_count++] = *entry;
+        }
+    }
+
+    free(pack->entries);
+    free(pack->new_entries);
+    pack->entries = merged;
+    pack->count = merged_count;
+    pack->new_entries = NULL;
+    pack->new_count = 0;
+    pack->new_capacity = 0;
+
+    return merged_count;
+}
+
+static void pack_write_index(store_t *store) {
+    pack_store_t *pack = PACK(store);
+
+    pack_merge_entries(pack);
+
+    char tmp_path[PATH_MAX];
+    char index_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s/" PACK_INDEX_FILENAME ".tmp", store->path);
+    snprintf(index_path, PATH_MAX, "%s/" PACK_INDEX_FILENAME, store->path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        LOG_FATALF("pack_store.c", "Could not open %s for writing: %s", tmp_path, strerror(errno))
+    }
+
+    pack_index_header_t header;
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = htole32(PACK_VERSION);
+    header.entry_size = htole32(sizeof(pack_index_entry_t));
+    header.count = htole64(pack->count);
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (size_t i = 0; i < pack->count; i++) {
+        pack_index_entry_t entry = pack->entries[i];
+        entry.segment = htole32(entry.segment);
+        entry.length = htole32(entry.length);
+        entry.offset = htole64(entry.offset);
+        fwrite(&entry, sizeof(entry), 1, file);
+    }
+    fclose(file);
+
+    // The segments must be on disk before the index that points to them
+    for (int i = 0; i < PACK_MAX_SEGMENTS; i++) {
+        if (pack->segment_fds[i] != -1) {
+            fsync(pack->segment_fds[i]);
+        }
+    }
+
+    if (rename(tmp_path, index_path) != 0) {
+        LOG_FATALF("pack_store.c", "Could not rename %s: %s", tmp_path, strerror(errno))
+    }
+
+    LOG_DEBUGF("pack_store.c", "Wrote %zu entries to %s", pack->count, index_path)
+}
+
+static void pack_store_destroy(store_t *store) {
+    pack_store_t *pack = PACK(store);
+
+    if (pack->dirty) {
+        pack_write_index(store);
+    }
+
+    for (int i = 0; i < PACK_MAX_SEGMENTS; i++) {
+        if (pack->segment_fds[i] != -1) {
+            close(pack->segment_fds[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&pack->mu);
+    free(pack->entries);
+    free(pack->new_entries);
+    free(pack->read_buf);
+    free(pack);
+    free(store);
+}
+
+/**
+ * Keys are converted to hex strings
+ */
+static GHashTable *pack_store_read_all(store_t *store) {
+    pack_store_t *pack = PACK(store);
+
+    GHashTable *table = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+
+    pthread_mutex_lock(&pack->mu);
+    if (pack->dirty) {
+        pack_merge_entries(pack);
+    }
+    size_t count = pack->count;
+    pthread_mutex_unlock(&pack->mu);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t value_len;
+        char *value = pack_store_read(store, (char *) pack->entries[i].key, MD5_DIGEST_LENGTH, &value_len);
+        if (value == NULL) {
+            continue;
+        }
+
+        char *key_str = malloc(MD5_STR_LENGTH);
+        buf2hex(pack->entries[i].key, MD5_DIGEST_LENGTH, key_str);
+        g_hash_table_insert(table, key_str, value);
+    }
+
+    return table;
+}
+
+static size_t pack_store_count(store_t *store) {
+    pack_store_t *pack = PACK(store);
+
+    pthread_mutex_lock(&pack->mu);
+    if (pack->dirty) {
+        pack_merge_entries(pack);
+    }
+    size_t count = pack->count;
+    pthread_mutex_unlock(&pack->mu);
+
+    return count;
+}
+
+static void pack_store_copy_keys(store_t *store, store_t *dst_store, const char *keys, size_t key_len,
+                                 size_t key_count, dyn_buffer_t *refs) {
+    for (size_t i = 0; i < key_count; i++) {
+        size_t value_len;
+        char *key = (char *) (keys + i * key_len);
+        char *value = pack_store_read(store, key, key_len, &value_len);
+        if (value != NULL) {
+            pack_store_write(dst_store, key, key_len, value, value_len);
+            if (refs != NULL && store_is_ref(value, value_len)) {
+                dyn_buffer_write(refs, value + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+            }
+            free(value);
+        }
+    }
+}
+
+static void pack_store_delete_keys(store_t *store, const char *keys, size_t key_len, size_t key_count) {
+    pack_store_t *pack = PACK(store);
+
+    if (key_len != MD5_DIGEST_LENGTH) {
+        return;
+    }
+
+    pthread_mutex_lock(&pack->mu);
+
+    // The keys are then found with a binary search instead of a scan of the new entries
+    if (pack->new_count > 0) {
+        pack_merge_entries(pack);
+    }
+
+    for (size_t i = 0; i < key_count; i++) {
+        pack_index_entry_t *entry = (pack_index_entry_t *) pack_find(pack, keys + i * key_len);
+        if (entry != NULL) {
+            entry->length = PACK_DELETED;
+            pack->dirty = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&pack->mu);
+}
+
+/**
+ * Only the live values are copied, the destination has no unused space
+ */
+static void pack_store_copy(store_t *store, const char *destination) {
+    pack_store_t *pack = PACK(store);
+
+    pthread_mutex_lock(&pack->mu);
+    if (pack->dirty) {
+        pack_merge_entries(pack);
+    }
+    pthread_mutex_unlock(&pack->mu);
+
+    store_t *dst_store = pack_store_create(destination);
+    // Write the index even if the store is empty
+    PACK(dst_store)->dirty = TRUE;
+    for (size_t i = 0; i < pack->count; i++) {
+        size_t value_len;
+        char *value = pack_store_read(store, (char *) pack->entries[i].key, MD5_DIGEST_LENGTH, &value_len);
+        if (value != NULL) {
+            pack_store_write(dst_store, (char *) pack->entries[i].key, MD5_DIGEST_LENGTH, value, value_len);
+            free(value);
+        }
+    }
+    pack_store_destroy(dst_store);
+}
+
+static void pack_store_read_refs(store_t *store, dyn_buffer_t *refs) {
+    pack_store_t *pack = PACK(store);
+
+    pthread_mutex_lock(&pack->mu);
+    if (pack->dirty) {
+        pack_merge_entries(pack);
+    }
+
+    for (size_t i = 0; i < pack->count; i++) {
+        const pack_index_entry_t *entry = &pack->entries[i];
+        if (entry->length != STORE_REF_SIZE) {
+            continue;
+        }
+
+        char value[STORE_REF_SIZE];
+        int fd = pack_segment_fd(store, (int) entry->segment);
+        if (pread(fd, value, STORE_REF_SIZE, (off_t) entry->offset) == STORE_REF_SIZE &&
+            store_is_ref(value, STORE_REF_SIZE)) {
+            dyn_buffer_write(refs, value + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+        }
+    }
+    pthread_mutex_unlock(&pack->mu);
+}
+
+static const store_ops_t PackStoreOps = {
+        .name = STORE_BACKEND_PACK,
+        .destroy = pack_store_destroy,
+        .write = pack_store_write,
+        .write_async = pack_store_write,
+        .flush = pack_store_flush,
+        .read = pack_store_read,
+        .read_begin = pack_store_read_begin,
+        .read_end = pack_store_read_end,
+        .read_all = pack_store_read_all,
+        .count = pack_store_count,
+        .copy_keys = pack_store_copy_keys,
+        .delete_keys = pack_store_delete_keys,
+        .copy = pack_store_copy,
+        .read_refs = pack_store_read_refs,
+};
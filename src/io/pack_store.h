@@ -0,0 +1,44 @@
+#ifndef SIST2_PACK_STORE_H
+#define SIST2_PACK_STORE_H
+
+#include "store.h"
+
+#include <stdint.h>
+#include <openssl/md5.h>
+
+#define PACK_INDEX_FILENAME "pack.index"
+#define PACK_SEGMENT_FILENAME_FORMAT "pack_%04d.dat"
+#define PACK_MAGIC "SIST2PCK"
+#define PACK_VERSION 1
+
+// A new segment file is started when the current one reaches this size
+#define PACK_SEGMENT_SIZE (1024L * 1024 * 1024)
+#define PACK_MAX_SEGMENTS 4096
+
+/*
+ * Append-only store for values that are written once, like thumbnails.
+ * The values are appended to segment files and pack.index lists the key,
+ * segment, offset and length of every value, sorted by key. pack.index is
+ * rewritten when the store is destroyed: the values written by a process
+ * that did not exit cleanly are lost.
+ * Keys are 16-byte md5 digests. All integers are little endian.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+} pack_index_header_t;
+
+typedef struct {
+    unsigned char key[MD5_DIGEST_LENGTH];
+    uint32_t segment;
+    uint32_t length;
+    uint64_t offset;
+} pack_index_entry_t;
+
+int pack_store_exists(const char *path);
+
+store_t *pack_store_create(const char *path);
+
+#endif
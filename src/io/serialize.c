@@ -2,8 +2,12 @@
 #include "serialize.h"
 #include "src/parsing/parse.h"
 #include "src/parsing/mime.h"
+#include "manifest.h"
 
 #include <zstd.h>
+#include <zdict.h>
+#include <time.h>
+#include <endian.h>
 
 char *get_meta_key_text(enum metakey meta_key) {
 
@@ -83,25 +87,32 @@ char *get_meta_key_text(enum metakey meta_key) {
     }
 }
 
-char *build_json_string(document_t *doc) {
-    cJSON *json = cJSON_CreateObject();
-    int buffer_size_guess = 8192;
-
-    const char *mime_text = mime_get_mime_text(doc->mime);
-    if (mime_text == NULL) {
-        cJSON_AddNullToObject(json, "mime");
-    } else {
-        cJSON_AddStringToObject(json, "mime", mime_text);
+int is_number_meta(enum metakey meta_key) {
+    switch (meta_key) {
+        case MetaPages:
+        case MetaWidth:
+        case MetaHeight:
+        case MetaMediaDuration:
+        case MetaMediaBitrate:
+            return TRUE;
+        default:
+            return FALSE;
     }
-    cJSON_AddNumberToObject(json, "size", (double) doc->size);
-    cJSON_AddNumberToObject(json, "mtime", doc->mtime);
+}
 
+/**
+ * Split doc->filepath (in place) into the extension, the escaped file name
+ * and the escaped path relative to the index root.
+ *
+ * Assumes that name & path are at least PATH_MAX * 3
+ */
+void document_path_fields(document_t *doc, char **extension, char *name, char *path) {
     // Ignore root directory in the file path
     doc->ext = (short) (doc->ext - ScanCtx.index.desc.root_len);
     doc->base = (short) (doc->base - ScanCtx.index.desc.root_len);
     char *filepath = doc->filepath + ScanCtx.index.desc.root_len;
 
-    cJSON_AddStringToObject(json, "extension", filepath + doc->ext);
+    *extension = filepath + doc->ext;
 
     // Remove extension
     if (*(filepath + doc->ext - 1) == '.') {
@@ -110,19 +121,37 @@ char *build_json_string(document_t *doc) {
         *(filepath + doc->ext) = '\0';
     }
 
-    char filepath_escaped[PATH_MAX * 3];
-    str_escape(filepath_escaped, filepath + doc->base);
-
-    cJSON_AddStringToObject(json, "name", filepath_escaped);
+    str_escape(name, filepath + doc->base);
 
     if (doc->base > 0) {
         *(filepath + doc->base - 1) = '\0';
+        str_escape(path, filepath);
+    } else {
+        *path = '\0';
+    }
+}
+
+char *build_json_string(document_t *doc) {
+    cJSON *json = cJSON_CreateObject();
+    int buffer_size_guess = 8192;
 
-        str_escape(filepath_escaped, filepath);
-        cJSON_AddStringToObject(json, "path", filepath_escaped);
+    const char *mime_text = mime_get_mime_text(doc->mime);
+    if (mime_text == NULL) {
+        cJSON_AddNullToObject(json, "mime");
     } else {
-        cJSON_AddStringToObject(json, "path", "");
+        cJSON_AddStringToObject(json, "mime", mime_text);
     }
+    cJSON_AddNumberToObject(json, "size", (double) doc->size);
+    cJSON_AddNumberToObject(json, "mtime", doc->mtime);
+
+    char *extension;
+    char name_escaped[PATH_MAX * 3];
+    char path_escaped[PATH_MAX * 3];
+    document_path_fields(doc, &extension, name_escaped, path_escaped);
+
+    cJSON_AddStringToObject(json, "extension", extension);
+    cJSON_AddStringToObject(json, "name", name_escaped);
+    cJSON_AddStringToObject(json, "path", path_escaped);
 
     char md5_str[MD5_STR_LENGTH];
     buf2hex(doc->path_md5, MD5_DIGEST_LENGTH, md5_str);
@@ -191,6 +220,72 @@ char *build_json_string(document_t *doc) {
     return json_str;
 }
 
+/*
+ * Binary index records (INDEX_TYPE_BIN), all integers are little endian:
+ *
+ *   uint32   record length (not including this field)
+ *   uint8    path md5 [16]
+ *   uint64   size
+ *   int32    mtime
+ *   uint32   mime id
+ *   { uint8 key, uint32 length, bytes[length] } * meta entries
+ *
+ * The extension, name and path strings are stored as meta entries with the
+ * reserved BIN_KEY_* keys. Number meta values are stored as uint64.
+ */
+#define BIN_RECORD_HEADER_SIZE (MD5_DIGEST_LENGTH + 8 + 4 + 4)
+#define BIN_ENTRY_HEADER_SIZE (1 + 4)
+#define BIN_KEY_EXTENSION 0xFD
+#define BIN_KEY_NAME 0xFE
+#define BIN_KEY_PATH 0xFF
+
+void bin_write_entry(dyn_buffer_t *buf, unsigned char key, const void *data, uint32_t len) {
+    uint32_t len_le = htole32(len);
+    dyn_buffer_write(buf, &key, sizeof(key));
+    dyn_buffer_write(buf, &len_le, sizeof(len_le));
+    dyn_buffer_write(buf, data, len);
+}
+
+void build_bin_record(document_t *doc, dyn_buffer_t *buf) {
+    uint32_t record_len = 0;
+    dyn_buffer_write(buf, &record_len, sizeof(record_len));
+
+    uint64_t size = htole64(doc->size);
+    int32_t mtime = (int32_t) htole32(doc->mtime);
+    uint32_t mime = htole32(doc->mime);
+    dyn_buffer_write(buf, doc->path_md5, MD5_DIGEST_LENGTH);
+    dyn_buffer_write(buf, &size, sizeof(size));
+    dyn_buffer_write(buf, &mtime, sizeof(mtime));
+    dyn_buffer_write(buf, &mime, sizeof(mime));
+
+    char *extension;
+    char name_escaped[PATH_MAX * 3];
+    char path_escaped[PATH_MAX * 3];
+    document_path_fields(doc, &extension, name_escaped, path_escaped);
+
+    bin_write_entry(buf, BIN_KEY_EXTENSION, extension, strlen(extension));
+    bin_write_entry(buf, BIN_KEY_NAME, name_escaped, strlen(name_escaped));
+    bin_write_entry(buf, BIN_KEY_PATH, path_escaped, strlen(path_escaped));
+
+    meta_line_t *meta = doc->meta_head;
+    while (meta != NULL) {
+
+        if (is_number_meta(meta->key)) {
+            uint64_t value = htole64(meta->long_val);
+            bin_write_entry(buf, meta->key, &value, sizeof(value));
+        } else {
+            bin_write_entry(buf, meta->key, meta->str_val, strlen(meta->str_val));
+        }
+
+        meta_line_t *tmp = meta;
+        meta = meta->next;
+        free(tmp);
+    }
+
+    record_len = htole32(buf->cur - sizeof(record_len));
+    memcpy(buf->buf, &record_len, sizeof(record_len));
+}
+
 static struct {
     FILE *out_file;
     size_t buf_out_size;
@@ -198,27 +293,149 @@ static struct {
     void *buf_out;
 
     ZSTD_CCtx *cctx;
+
+    size_t bytes_in;
+    size_t bytes_out;
+    size_t frame_bytes_in;
+    size_t frame_start;
+    dyn_buffer_t seek_table;
+    int frame_count;
 } WriterCtx = {
         .out_file =  NULL
 };
 
+#define DICT_STATE_DISABLED 0
+#define DICT_STATE_SAMPLING 1
+#define DICT_STATE_DONE 2
+
+/**
+ * Dictionary training state. Outlives a single index file so that the
+ * incremental copy is compressed with the same dictionary.
+ */
+static struct {
+    int state;
+    int sample_cnt;
+    dyn_buffer_t samples;
+    size_t *sample_sizes;
+
+    void *dict;
+    size_t dict_size;
+} WriterDictCtx = {
+        .state = DICT_STATE_DISABLED
+};
+
 #define ZSTD_COMPRESSION_LEVEL 10
+#define ZSTD_DICT_CAPACITY (1024 * 110)
+
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEK_TABLE_SKIPPABLE_MAGIC (ZSTD_MAGIC_SKIPPABLE_START | 0xE)
+#define ZSTD_SEEK_TABLE_FOOTER_SIZE 9
+#define ZSTD_DICT_FILENAME "dictionary.zdict"
 
 void initialize_writer_ctx(const char *file_path) {
     WriterCtx.out_file = fopen(file_path, "wb");
 
     WriterCtx.buf_out_size = ZSTD_CStreamOutSize();
     WriterCtx.buf_out = malloc(WriterCtx.buf_out_size);
+    WriterCtx.bytes_in = 0;
+    WriterCtx.bytes_out = 0;
+    WriterCtx.frame_bytes_in = 0;
+    WriterCtx.frame_start = 0;
+    WriterCtx.frame_count = 0;
+    WriterCtx.seek_table = dyn_buffer_create();
 
     WriterCtx.cctx = ZSTD_createCCtx();
 
-    ZSTD_CCtx_setParameter(WriterCtx.cctx, ZSTD_c_compressionLevel, ZSTD_COMPRESSION_LEVEL);
+    int level = ScanCtx.index.desc.compression_level;
+    if (level == 0) {
+        level = ZSTD_COMPRESSION_LEVEL;
+    }
+
+    ZSTD_CCtx_setParameter(WriterCtx.cctx, ZSTD_c_compressionLevel, level);
     ZSTD_CCtx_setParameter(WriterCtx.cctx, ZSTD_c_checksumFlag, FALSE);
 
-    LOG_DEBUGF("serialize.c", "Open index file for writing %s", file_path)
+    if (ScanCtx.index.desc.compression_workers > 0) {
+        size_t ret = ZSTD_CCtx_setParameter(WriterCtx.cctx, ZSTD_c_nbWorkers,
+                                            ScanCtx.index.desc.compression_workers);
+        if (ZSTD_isError(ret)) {
+            LOG_WARNINGF("serialize.c", "Could not enable multi-threaded compression: %s",
+                         ZSTD_getErrorName(ret))
+            ScanCtx.index.desc.compression_workers = 0;
+        }
+    }
+
+    if (ScanCtx.index.desc.compression_ldm) {
+        ZSTD_CCtx_setParameter(WriterCtx.cctx, ZSTD_c_enableLongDistanceMatching, TRUE);
+    }
+
+    if (WriterDictCtx.state == DICT_STATE_DONE && WriterDictCtx.dict != NULL) {
+        ZSTD_CCtx_loadDictionary(WriterCtx.cctx, WriterDictCtx.dict, WriterDictCtx.dict_size);
+    } else if (WriterDictCtx.state == DICT_STATE_DISABLED && ScanCtx.compression_dict_samples > 0) {
+        WriterDictCtx.state = DICT_STATE_SAMPLING;
+        WriterDictCtx.sample_cnt = 0;
+        WriterDictCtx.samples = dyn_buffer_create();
+        WriterDictCtx.sample_sizes = malloc(sizeof(size_t) * ScanCtx.compression_dict_samples);
+    }
+
+    LOG_DEBUGF("serialize.c", "Open index file for writing %s (level=%d, workers=%d, ldm=%d)", file_path,
+               level, ScanCtx.index.desc.compression_workers, ScanCtx.index.desc.compression_ldm)
 }
 
-void zstd_write_string(const char *string, const size_t len) {
+void zstd_write_output(size_t len) {
+    size_t written = fwrite(WriterCtx.buf_out, 1, len, WriterCtx.out_file);
+    WriterCtx.bytes_out += written;
+    ScanCtx.stat_index_size += written;
+}
+
+/**
+ * Frames are independent and always end on a line boundary, their sizes
+ * are kept for the seek table.
+ */
+void zstd_end_frame() {
+    size_t remaining;
+    do {
+        ZSTD_outBuffer output = {WriterCtx.buf_out, WriterCtx.buf_out_size, 0};
+        ZSTD_inBuffer input = {NULL, 0, 0};
+        remaining = ZSTD_compressStream2(WriterCtx.cctx, &output, &input, ZSTD_e_end);
+
+        if (output.pos > 0) {
+            zstd_write_output(output.pos);
+        }
+    } while (remaining != 0);
+
+    uint32_t compressed_size = htole32((uint32_t) (WriterCtx.bytes_out - WriterCtx.frame_start));
+    uint32_t decompressed_size = htole32((uint32_t) WriterCtx.frame_bytes_in);
+    dyn_buffer_write(&WriterCtx.seek_table, &compressed_size, sizeof(compressed_size));
+    dyn_buffer_write(&WriterCtx.seek_table, &decompressed_size, sizeof(decompressed_size));
+    WriterCtx.frame_count += 1;
+
+    WriterCtx.frame_start = WriterCtx.bytes_out;
+    WriterCtx.frame_bytes_in = 0;
+}
+
+/**
+ * Append the seek table in a skippable frame (zstd seekable format, without
+ * checksums). Stream decoders ignore it.
+ */
+void zstd_write_seek_table() {
+    uint32_t magic = htole32(ZSTD_SEEK_TABLE_SKIPPABLE_MAGIC);
+    uint32_t frame_size = htole32(WriterCtx.seek_table.cur + ZSTD_SEEK_TABLE_FOOTER_SIZE);
+    uint32_t frame_count = htole32(WriterCtx.frame_count);
+    uint8_t descriptor = 0;
+    uint32_t seekable_magic = htole32(ZSTD_SEEKABLE_MAGIC);
+
+    size_t written = 0;
+    written += fwrite(&magic, sizeof(magic), 1, WriterCtx.out_file) * sizeof(magic);
+    written += fwrite(&frame_size, sizeof(frame_size), 1, WriterCtx.out_file) * sizeof(frame_size);
+    written += fwrite(WriterCtx.seek_table.buf, 1, WriterCtx.seek_table.cur, WriterCtx.out_file);
+    written += fwrite(&frame_count, sizeof(frame_count), 1, WriterCtx.out_file) * sizeof(frame_count);
+    written += fwrite(&descriptor, sizeof(descriptor), 1, WriterCtx.out_file) * sizeof(descriptor);
+    written += fwrite(&seekable_magic, sizeof(seekable_magic), 1, WriterCtx.out_file) * sizeof(seekable_magic);
+
+    ScanCtx.stat_index_size += written;
+}
+
+void zstd_compress_string(const char *string, const size_t len) {
     ZSTD_inBuffer input = {string, len, 0};
 
     do {
@@ -226,21 +443,115 @@ void zstd_write_string(const char *string, const size_t len) {
         ZSTD_compressStream2(WriterCtx.cctx, &output, &input, ZSTD_e_continue);
 
         if (output.pos > 0) {
-            ScanCtx.stat_index_size += fwrite(WriterCtx.buf_out, 1, output.pos, WriterCtx.out_file);
+            zstd_write_output(output.pos);
         }
     } while (input.pos != input.size);
+
+    WriterCtx.bytes_in += len;
+    WriterCtx.frame_bytes_in += len;
+
+    if (WriterCtx.frame_bytes_in >= ScanCtx.index.desc.compression_frame_size) {
+        zstd_end_frame();
+    }
+}
+
+/**
+ * Train the dictionary on the buffered samples, save it next to the
+ * index files and compress the samples with it.
+ */
+void zstd_train_dict() {
+    WriterDictCtx.state = DICT_STATE_DONE;
+
+    void *dict = malloc(ZSTD_DICT_CAPACITY);
+    size_t dict_size = ZDICT_trainFromBuffer(dict, ZSTD_DICT_CAPACITY,
+                                             WriterDictCtx.samples.buf, WriterDictCtx.sample_sizes,
+                                             WriterDictCtx.sample_cnt);
+
+    if (ZDICT_isError(dict_size)) {
+        LOG_WARNINGF("serialize.c", "Could not train zstd dictionary from %d samples: %s",
+                     WriterDictCtx.sample_cnt, ZDICT_getErrorName(dict_size))
+        free(dict);
+    } else {
+        char dict_path[PATH_MAX];
+        snprintf(dict_path, PATH_MAX, "%s" ZSTD_DICT_FILENAME, ScanCtx.index.path);
+
+        FILE *dict_file = fopen(dict_path, "wb");
+        if (dict_file == NULL) {
+            LOG_FATALF("serialize.c", "Could not open dictionary file %s: %s", dict_path, strerror(errno))
+        }
+        fwrite(dict, 1, dict_size, dict_file);
+        fclose(dict_file);
+
+        WriterDictCtx.dict = dict;
+        WriterDictCtx.dict_size = dict_size;
+        strcpy(ScanCtx.index.desc.compression_dict, ZSTD_DICT_FILENAME);
+
+        ZSTD_CCtx_loadDictionary(WriterCtx.cctx, dict, dict_size);
+
+        LOG_INFOF("serialize.c", "Trained %zukB zstd dictionary from %d documents",
+                  dict_size / 1024, WriterDictCtx.sample_cnt)
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < WriterDictCtx.sample_cnt; i++) {
+        zstd_compress_string(WriterDictCtx.samples.buf + offset, WriterDictCtx.sample_sizes[i]);
+        offset += WriterDictCtx.sample_sizes[i];
+    }
+
+    dyn_buffer_destroy(&WriterDictCtx.samples);
+    free(WriterDictCtx.sample_sizes);
+}
+
+void zstd_write_string(const char *string, const size_t len) {
+
+    if (WriterDictCtx.state == DICT_STATE_SAMPLING) {
+        dyn_buffer_write(&WriterDictCtx.samples, string, len);
+        WriterDictCtx.sample_sizes[WriterDictCtx.sample_cnt++] = len;
+
+        if (WriterDictCtx.sample_cnt == ScanCtx.compression_dict_samples) {
+            zstd_train_dict();
+        }
+        return;
+    }
+
+    zstd_compress_string(string, len);
 }
 
 void write_document_func(void *arg) {
 
     if (WriterCtx.out_file == NULL) {
         char dstfile[PATH_MAX];
-        snprintf(dstfile, PATH_MAX, "%s_index_main.ndjson.zst", ScanCtx.index.path);
+        if (ScanCtx.generation == 0) {
+            snprintf(dstfile, PATH_MAX, "%s_index_main.%s.zst", ScanCtx.index.path, ScanCtx.index.desc.type);
+        } else {
+            snprintf(dstfile, PATH_MAX, "%s_index_delta_%d.%s.zst", ScanCtx.index.path, ScanCtx.generation,
+                     ScanCtx.index.desc.type);
+        }
         initialize_writer_ctx(dstfile);
     }
 
     document_t *doc = arg;
 
+    manifest_add(doc->path_md5, doc->mtime, doc->size,
+                 (doc->has_parent ? MANIFEST_FLAG_PARENT : 0) | (doc->deferred ? MANIFEST_FLAG_DEFERRED : 0));
+    if (ScanCtx.original_table != NULL) {
+        int original_mtime = inc_table_get(ScanCtx.original_table, doc->path_md5);
+        changes_add(doc->path_md5, original_mtime == 0 ? CHANGE_NEW : CHANGE_MODIFIED);
+
+        // The previous version of the document is tombstoned at the end of in-place scans
+        inc_table_mark(ScanCtx.original_table, doc->path_md5, INC_TABLE_FLAG_REWRITTEN);
+    }
+
+    if (strcmp(ScanCtx.index.desc.type, INDEX_TYPE_BIN) == 0) {
+        dyn_buffer_t buf = dyn_buffer_create();
+        build_bin_record(doc, &buf);
+        zstd_write_string(buf.buf, buf.cur);
+
+        dyn_buffer_destroy(&buf);
+        free(doc->filepath);
+        return;
+    }
+
     char *json_str = build_json_string(doc);
     const size_t json_str_len = strlen(json_str);
 
@@ -259,20 +570,27 @@ void zstd_close() {
         return;
     }
 
-    size_t remaining;
-    do {
-        ZSTD_outBuffer output = {WriterCtx.buf_out, WriterCtx.buf_out_size, 0};
-        remaining = ZSTD_endStream(WriterCtx.cctx, &output);
+    if (WriterDictCtx.state == DICT_STATE_SAMPLING) {
+        zstd_train_dict();
+    }
 
-        if (output.pos > 0) {
-            ScanCtx.stat_index_size += fwrite(WriterCtx.buf_out, 1, output.pos, WriterCtx.out_file);
-        }
-    } while (remaining != 0);
+    if (WriterCtx.frame_bytes_in > 0 || WriterCtx.frame_count == 0) {
+        zstd_end_frame();
+    }
+    zstd_write_seek_table();
 
     ZSTD_freeCCtx(WriterCtx.cctx);
     free(WriterCtx.buf_out);
+    dyn_buffer_destroy(&WriterCtx.seek_table);
     fclose(WriterCtx.out_file);
 
+    if (WriterCtx.bytes_in > 0) {
+        LOG_INFOF("serialize.c", "Index file compression ratio: %.2f (%zukB -> %zukB, %d frames, dictionary=%d)",
+                  (double) WriterCtx.bytes_in / (double) MAX(WriterCtx.bytes_out, 1),
+                  WriterCtx.bytes_in / 1024, WriterCtx.bytes_out / 1024, WriterCtx.frame_count,
+                  WriterDictCtx.dict != NULL)
+    }
+
     LOG_DEBUG("serialize.c", "End zstd stream & close index file")
 }
 
@@ -291,7 +609,24 @@ void write_index_descriptor(char *path, index_descriptor_t *desc) {
     cJSON_AddStringToObject(json, "rewrite_url", desc->rewrite_url);
     cJSON_AddNumberToObject(json, "timestamp", (double) desc->timestamp);
 
-    int fd = open(path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+    cJSON *compression = cJSON_AddObjectToObject(json, "compression");
+    cJSON_AddStringToObject(compression, "algorithm", "zstd");
+    cJSON_AddNumberToObject(compression, "level", desc->compression_level);
+    cJSON_AddNumberToObject(compression, "workers", desc->compression_workers);
+    cJSON_AddBoolToObject(compression, "long_distance_matching", desc->compression_ldm);
+    if (*desc->compression_dict != '\0') {
+        cJSON_AddStringToObject(compression, "dictionary", desc->compression_dict);
+    } else {
+        cJSON_AddNullToObject(compression, "dictionary");
+    }
+    cJSON_AddNumberToObject(compression, "frame_size", (double) desc->compression_frame_size);
+
+    cJSON *thumbnails = cJSON_AddObjectToObject(json, "thumbnails");
+    cJSON_AddNumberToObject(thumbnails, "size", desc->thumbnail_size);
+    cJSON_AddItemToObject(thumbnails, "tiers",
+                          cJSON_CreateIntArray(desc->thumbnail_tiers.sizes, desc->thumbnail_tiers.count));
+
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         LOG_FATALF("serialize.c", "Could not open index descriptor: %s", strerror(errno));
     }
@@ -340,6 +675,45 @@ index_descriptor_t read_index_descriptor(char *path) {
         strcpy(descriptor.type, cJSON_GetObjectItem(json, "type")->valuestring);
     }
 
+    cJSON *compression = cJSON_GetObjectItem(json, "compression");
+    if (compression == NULL) {
+        descriptor.compression_level = ZSTD_COMPRESSION_LEVEL;
+        descriptor.compression_workers = 0;
+        descriptor.compression_ldm = FALSE;
+    } else {
+        descriptor.compression_level = cJSON_GetObjectItem(compression, "level")->valueint;
+        descriptor.compression_workers = cJSON_GetObjectItem(compression, "workers")->valueint;
+        descriptor.compression_ldm = cJSON_IsTrue(cJSON_GetObjectItem(compression, "long_distance_matching"));
+    }
+
+    cJSON *frame_size = cJSON_GetObjectItem(compression, "frame_size");
+    if (frame_size != NULL) {
+        descriptor.compression_frame_size = (long) frame_size->valuedouble;
+    } else {
+        descriptor.compression_frame_size = 0;
+    }
+
+    cJSON *dictionary = cJSON_GetObjectItem(compression, "dictionary");
+    if (dictionary != NULL && cJSON_IsString(dictionary)) {
+        strcpy(descriptor.compression_dict, dictionary->valuestring);
+    } else {
+        *descriptor.compression_dict = '\0';
+    }
+
+    // Indices written before the thumbnail tiers only have the default size
+    cJSON *thumbnails = cJSON_GetObjectItem(json, "thumbnails");
+    descriptor.thumbnail_size = 0;
+    descriptor.thumbnail_tiers.count = 0;
+    if (thumbnails != NULL) {
+        descriptor.thumbnail_size = cJSON_GetObjectItem(thumbnails, "size")->valueint;
+        cJSON *tier;
+        cJSON_ArrayForEach(tier, cJSON_GetObjectItem(thumbnails, "tiers")) {
+            if (descriptor.thumbnail_tiers.count < MAX_THUMBNAIL_TIERS) {
+                descriptor.thumbnail_tiers.sizes[descriptor.thumbnail_tiers.count++] = tier->valueint;
+            }
+        }
+    }
+
     cJSON_Delete(json);
     free(buf);
 
@@ -354,22 +728,74 @@ void write_document(document_t *doc) {
 void thread_cleanup() {
     cleanup_parse();
     cleanup_font();
+    cleanup_media();
+}
+
+/*
+ * The tags and sidecar meta of the documents are looked up in the stores
+ * while the index files are read, with a read transaction per thread.
+ * Documents often share the same tags: the parsed tag arrays are cached
+ * by value and added to the documents by reference.
+ */
+static __thread MDB_txn *TagsTxn = NULL;
+static __thread MDB_txn *MetaTxn = NULL;
+static __thread GHashTable *TagsCache = NULL;
+
+static void tags_cache_free(void *tags) {
+    cJSON_Delete(tags);
+}
+
+void read_index_thread_cleanup() {
+    store_txn_close(TagsTxn);
+    TagsTxn = NULL;
+    store_txn_close(MetaTxn);
+    MetaTxn = NULL;
+
+    if (TagsCache != NULL) {
+        g_hash_table_destroy(TagsCache);
+        TagsCache = NULL;
+    }
+}
+
+static cJSON *read_document_tags(const char *path_md5_str) {
+    size_t len;
+    const char *tags_string = store_txn_read(IndexCtx.tag_store, &TagsTxn, path_md5_str, MD5_STR_LENGTH, &len);
+    if (tags_string == NULL) {
+        store_txn_reset(TagsTxn);
+        return NULL;
+    }
+
+    if (TagsCache == NULL) {
+        TagsCache = g_hash_table_new_full(g_str_hash, g_str_equal, free, tags_cache_free);
+    }
+
+    cJSON *tags_arr = g_hash_table_lookup(TagsCache, tags_string);
+    if (tags_arr == NULL) {
+        tags_arr = cJSON_Parse(tags_string);
+        g_hash_table_insert(TagsCache, strdup(tags_string), tags_arr);
+    }
+    store_txn_reset(TagsTxn);
+
+    return tags_arr;
 }
 
-void read_index_bin_handle_line(const char *line, const char *index_id, index_func func) {
+void read_index_handle_document(cJSON *document, const char *index_id, index_func func) {
 
-    cJSON *document = cJSON_Parse(line);
     const char *path_md5_str = cJSON_GetObjectItem(document, "_id")->valuestring;
 
     cJSON_AddStringToObject(document, "index", index_id);
 
     // Load meta from sidecar files
     cJSON *meta_obj = NULL;
-    if (IndexCtx.meta != NULL) {
-        const char *meta_string = g_hash_table_lookup(IndexCtx.meta, path_md5_str);
+    if (IndexCtx.meta_store != NULL) {
+        size_t len;
+        const char *meta_string = store_txn_read(IndexCtx.meta_store, &MetaTxn, path_md5_str, MD5_STR_LENGTH, &len);
         if (meta_string != NULL) {
             meta_obj = cJSON_Parse(meta_string);
+        }
+        store_txn_reset(MetaTxn);
 
+        if (meta_obj != NULL) {
             cJSON *child;
             for (child = meta_obj->child; child != NULL; child = child->next) {
                 char meta_key[4096];
@@ -381,12 +807,11 @@ void read_index_bin_handle_line(const char *line, const char *index_id, index_fu
     }
 
     // Load tags from tags DB
-    if (IndexCtx.tags != NULL) {
-        const char *tags_string = g_hash_table_lookup(IndexCtx.tags, path_md5_str);
-        if (tags_string != NULL) {
-            cJSON *tags_arr = cJSON_Parse(tags_string);
+    if (IndexCtx.tag_store != NULL) {
+        cJSON *tags_arr = read_document_tags(path_md5_str);
+        if (tags_arr != NULL) {
             cJSON_DeleteItemFromObject(document, "tag");
-            cJSON_AddItemToObject(document, "tag", tags_arr);
+            cJSON_AddItemReferenceToObject(document, "tag", tags_arr);
         }
     }
 
@@ -398,8 +823,400 @@ void read_index_bin_handle_line(const char *line, const char *index_id, index_fu
     }
 }
 
-void read_index_ndjson(const char *path, const char *index_id, index_func func) {
-    dyn_buffer_t buf = dyn_buffer_create();
+/**
+ * Called for each raw record of an index file: a null-terminated NDJSON line
+ * (without the newline) or a binary record (without its length prefix).
+ * record[len] must be writable.
+ */
+typedef void (*index_record_func)(char *record, size_t len, const char *index_id, index_func func);
+
+void read_index_ndjson_handle_line(char *line, UNUSED(size_t len), const char *index_id, index_func func) {
+    read_index_handle_document(cJSON_Parse(line), index_id, func);
+}
+
+/*
+ * Some readers only need a few fields of the NDJSON lines written by
+ * build_json_string(). Quotes are always escaped inside of JSON strings,
+ * so these patterns can only match keys.
+ */
+#define NDJSON_ID_PATTERN "\"_id\":\""
+#define NDJSON_MTIME_PATTERN "\"mtime\":"
+#define NDJSON_SIZE_PATTERN "\"size\":"
+#define NDJSON_PARENT_PATTERN "\"parent\":\""
+
+static const char *ndjson_find_value(const char *line, const char *pattern) {
+    const char *ptr = strstr(line, pattern);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    return ptr + strlen(pattern);
+}
+
+static void ndjson_get_id(const char *line, unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    const char *id = ndjson_find_value(line, NDJSON_ID_PATTERN);
+    if (id == NULL) {
+        LOG_FATALF("serialize.c", "Invalid document in index: %.128s", line)
+    }
+    hex2buf(id, MD5_STR_LENGTH - 1, path_md5);
+}
+
+static int ndjson_get_mtime(const char *line) {
+    const char *mtime = ndjson_find_value(line, NDJSON_MTIME_PATTERN);
+    return mtime == NULL ? 0 : (int) strtol(mtime, NULL, 10);
+}
+
+/*
+ * In-place incremental scans append a delta index file
+ * (_index_delta_<generation>.*) and a tombstones_<generation>.bin file with
+ * the path md5 of the documents that were deleted or rewritten. A record of
+ * an index file is ignored if there is a tombstone with a greater generation
+ * for its document. The _index_main.* file is generation 0.
+ */
+#define TOMBSTONES_PREFIX "tombstones_"
+#define TOMBSTONES_FILENAME_FORMAT TOMBSTONES_PREFIX "%d.bin"
+
+/**
+ * _index_main.ndjson.zst -> 0, _index_delta_3.ndjson.zst -> 3, tombstones_3.bin -> 3
+ */
+int index_file_generation(const char *filename) {
+    const char *dot = strchr(filename, '.');
+    const char *end = dot == NULL ? filename + strlen(filename) : dot;
+
+    const char *ptr = end;
+    while (ptr > filename && isdigit(*(ptr - 1))) {
+        ptr -= 1;
+    }
+
+    if (ptr == end || ptr == filename || *(ptr - 1) != '_') {
+        return 0;
+    }
+    return (int) strtol(ptr, NULL, 10);
+}
+
+static int is_index_file(const char *filename) {
+    return strncmp(filename, "_index_", sizeof("_index_") - 1) == 0;
+}
+
+static int is_tombstones_file(const char *filename) {
+    return strncmp(filename, TOMBSTONES_PREFIX, sizeof(TOMBSTONES_PREFIX) - 1) == 0;
+}
+
+int index_next_generation(const char *index_path) {
+    DIR *dir = opendir(index_path);
+    if (dir == NULL) {
+        LOG_FATALF("serialize.c", "Could not open index %s: %s", index_path, strerror(errno))
+    }
+
+    int generation = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (is_index_file(de->d_name) || is_tombstones_file(de->d_name)) {
+            generation = MAX(generation, index_file_generation(de->d_name));
+        }
+    }
+    closedir(dir);
+
+    return generation + 1;
+}
+
+/**
+ * @return table of path md5 -> latest tombstone generation, NULL if the
+ * index has no tombstones
+ */
+inc_table_t *read_index_tombstones(const char *index_path) {
+    DIR *dir = opendir(index_path);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    inc_table_t *table = NULL;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!is_tombstones_file(de->d_name)) {
+            continue;
+        }
+
+        char file_path[PATH_MAX];
+        snprintf(file_path, PATH_MAX, "%s%s", index_path, de->d_name);
+        int generation = index_file_generation(de->d_name);
+
+        FILE *file = fopen(file_path, "rb");
+        if (file == NULL) {
+            LOG_FATALF("serialize.c", "Could not open %s: %s", file_path, strerror(errno))
+        }
+        if (table == NULL) {
+            table = inc_table_create(0);
+        }
+
+        unsigned char path_md5[MD5_DIGEST_LENGTH];
+        while (fread(path_md5, MD5_DIGEST_LENGTH, 1, file) == 1) {
+            if (inc_table_get(table, path_md5) < generation) {
+                inc_table_put(table, path_md5, generation, 0);
+            }
+        }
+        fclose(file);
+    }
+    closedir(dir);
+
+    if (table != NULL) {
+        LOG_DEBUGF("serialize.c", "Loaded %zu tombstones from %s", table->count, index_path)
+    }
+    return table;
+}
+
+static pthread_mutex_t TombstonesMu = PTHREAD_MUTEX_INITIALIZER;
+static char TombstonesPath[PATH_MAX] = "";
+static inc_table_t *Tombstones = NULL;
+
+static void invalidate_tombstones() {
+    pthread_mutex_lock(&TombstonesMu);
+    if (Tombstones != NULL) {
+        inc_table_destroy(Tombstones);
+        Tombstones = NULL;
+    }
+    *TombstonesPath = '\0';
+    pthread_mutex_unlock(&TombstonesMu);
+}
+
+void write_index_tombstones(const char *index_path, int generation, const char *path_md5s, size_t count) {
+    char file_path[PATH_MAX];
+    snprintf(file_path, PATH_MAX, "%s" TOMBSTONES_FILENAME_FORMAT, index_path, generation);
+
+    FILE *file = fopen(file_path, "wb");
+    if (file == NULL) {
+        LOG_FATALF("serialize.c", "Could not open %s for writing: %s", file_path, strerror(errno))
+    }
+    fwrite(path_md5s, MD5_DIGEST_LENGTH, count, file);
+    fclose(file);
+
+    invalidate_tombstones();
+}
+
+typedef struct {
+    inc_table_t *tombstones;
+    int generation;
+} read_filter_t;
+
+/**
+ * Tombstones of the index that contains the index file at path. They are
+ * loaded once per index directory.
+ */
+read_filter_t read_index_filter(const char *path) {
+    char index_path[PATH_MAX];
+    const char *last_slash = strrchr(path, '/');
+    int dir_len = last_slash == NULL ? 0 : (int) (last_slash - path + 1);
+    snprintf(index_path, PATH_MAX, "%.*s", dir_len, path);
+
+    read_filter_t filter;
+
+    pthread_mutex_lock(&TombstonesMu);
+    if (strcmp(index_path, TombstonesPath) != 0) {
+        if (Tombstones != NULL) {
+            inc_table_destroy(Tombstones);
+        }
+        Tombstones = read_index_tombstones(index_path);
+        strcpy(TombstonesPath, index_path);
+    }
+    filter.tombstones = Tombstones;
+    pthread_mutex_unlock(&TombstonesMu);
+
+    filter.generation = index_file_generation(path + dir_len);
+    return filter;
+}
+
+__always_inline
+static int read_filter_skip(const read_filter_t *filter, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    return filter->tombstones != NULL && inc_table_get(filter->tombstones, path_md5) > filter->generation;
+}
+
+static uint32_t bin_read_u32(const char *ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return le32toh(value);
+}
+
+static uint64_t bin_read_u64(const char *ptr) {
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return le64toh(value);
+}
+
+/**
+ * Add a string that is not null-terminated to a cJSON object.
+ * Temporarily overwrites str[len], which must be writable.
+ */
+static void bin_add_string(cJSON *json, const char *name, char *str, uint32_t len) {
+    char tmp = str[len];
+    str[len] = '\0';
+    cJSON_AddStringToObject(json, name, str);
+    str[len] = tmp;
+}
+
+static int bin_record_has_parent(const char *record, size_t len) {
+    const char *ptr = record + BIN_RECORD_HEADER_SIZE;
+    const char *end = record + len;
+    while (end - ptr >= BIN_ENTRY_HEADER_SIZE) {
+        if (*(unsigned char *) ptr == MetaParent) {
+            return TRUE;
+        }
+        ptr += BIN_ENTRY_HEADER_SIZE + bin_read_u32(ptr + 1);
+    }
+    return FALSE;
+}
+
+/**
+ * Convert a binary record (without its length prefix) to the same
+ * document that build_json_string() would have produced.
+ */
+cJSON *bin_record_to_json(char *record, size_t len) {
+
+    if (len < BIN_RECORD_HEADER_SIZE) {
+        LOG_FATALF("serialize.c", "Invalid binary index record (length=%zu)", len)
+    }
+
+    cJSON *json = cJSON_CreateObject();
+
+    const unsigned char *path_md5 = (unsigned char *) record;
+    uint64_t size = bin_read_u64(record + MD5_DIGEST_LENGTH);
+    int mtime = (int) bin_read_u32(record + MD5_DIGEST_LENGTH + 8);
+    unsigned int mime = bin_read_u32(record + MD5_DIGEST_LENGTH + 12);
+
+    const char *mime_text = mime_get_mime_text(mime);
+    if (mime_text == NULL) {
+        cJSON_AddNullToObject(json, "mime");
+    } else {
+        cJSON_AddStringToObject(json, "mime", mime_text);
+    }
+    cJSON_AddNumberToObject(json, "size", (double) size);
+    cJSON_AddNumberToObject(json, "mtime", mtime);
+
+    char md5_str[MD5_STR_LENGTH];
+    buf2hex(path_md5, MD5_DIGEST_LENGTH, md5_str);
+    int id_added = FALSE;
+
+    char *ptr = record + BIN_RECORD_HEADER_SIZE;
+    char *end = record + len;
+    while (ptr < end) {
+        if (end - ptr < BIN_ENTRY_HEADER_SIZE) {
+            LOG_FATALF("serialize.c", "Truncated entry in binary index record %s", md5_str)
+        }
+        unsigned char key = *(unsigned char *) ptr;
+        uint32_t value_len = bin_read_u32(ptr + 1);
+        char *value = ptr + BIN_ENTRY_HEADER_SIZE;
+        if (value_len > end - value) {
+            LOG_FATALF("serialize.c", "Truncated entry in binary index record %s", md5_str)
+        }
+
+        // Keep the key order of build_json_string(): path fields, _id, metadata
+        if (!id_added && key != BIN_KEY_EXTENSION && key != BIN_KEY_NAME && key != BIN_KEY_PATH) {
+            cJSON_AddStringToObject(json, "_id", md5_str);
+            id_added = TRUE;
+        }
+
+        if (key == BIN_KEY_EXTENSION) {
+            bin_add_string(json, "extension", value, value_len);
+        } else if (key == BIN_KEY_NAME) {
+            bin_add_string(json, "name", value, value_len);
+        } else if (key == BIN_KEY_PATH) {
+            bin_add_string(json, "path", value, value_len);
+        } else if (is_number_meta(key)) {
+            cJSON_AddNumberToObject(json, get_meta_key_text(key), (double) bin_read_u64(value));
+        } else {
+            bin_add_string(json, get_meta_key_text(key), value, value_len);
+        }
+
+        ptr = value + value_len;
+    }
+
+    if (!id_added) {
+        cJSON_AddStringToObject(json, "_id", md5_str);
+    }
+
+    return json;
+}
+
+void read_index_bin_handle_record(char *record, size_t len, const char *index_id, index_func func) {
+    read_index_handle_document(bin_record_to_json(record, len), index_id, func);
+}
+
+/**
+ * Call record_func for each complete record in data
+ *
+ * @return number of bytes consumed
+ */
+size_t read_index_bin_records(char *data, size_t len, const char *index_id, index_func func,
+                              index_record_func record_func, const read_filter_t *filter) {
+    size_t pos = 0;
+    while (len - pos >= sizeof(uint32_t)) {
+        uint32_t record_len = bin_read_u32(data + pos);
+        if (len - pos - sizeof(uint32_t) < record_len) {
+            break;
+        }
+        char *record = data + pos + sizeof(uint32_t);
+        if (!read_filter_skip(filter, (unsigned char *) record)) {
+            record_func(record, record_len, index_id, func);
+        }
+        pos += sizeof(uint32_t) + record_len;
+    }
+    return pos;
+}
+
+/**
+ * Load the zstd dictionary referenced by the descriptor, it is stored
+ * in the same directory as the index file.
+ */
+void *read_index_dict(const char *path, index_descriptor_t *desc, size_t *dict_size) {
+
+    char dict_path[PATH_MAX];
+    const char *last_slash = strrchr(path, '/');
+    int dir_len = last_slash == NULL ? 0 : (int) (last_slash - path + 1);
+    snprintf(dict_path, PATH_MAX, "%.*s%s", dir_len, path, desc->compression_dict);
+
+    struct stat info;
+    if (stat(dict_path, &info) != 0) {
+        LOG_FATALF("serialize.c", "Could not find index dictionary %s: %s", dict_path, strerror(errno))
+    }
+
+    int fd = open(dict_path, O_RDONLY);
+    if (fd == -1) {
+        LOG_FATALF("serialize.c", "Could not open index dictionary %s: %s", dict_path, strerror(errno))
+    }
+
+    void *dict = malloc(info.st_size);
+    size_t ret = read(fd, dict, info.st_size);
+    if (ret != info.st_size) {
+        LOG_FATALF("serialize.c", "Could not read index dictionary %s: %s", dict_path, strerror(errno))
+    }
+    close(fd);
+
+    *dict_size = info.st_size;
+    return dict;
+}
+
+void writer_load_index_dict(const char *index_path, index_descriptor_t *desc) {
+    if (*desc->compression_dict == '\0') {
+        return;
+    }
+
+    WriterDictCtx.dict = read_index_dict(index_path, desc, &WriterDictCtx.dict_size);
+    WriterDictCtx.state = DICT_STATE_DONE;
+}
+
+typedef struct {
+    dyn_buffer_t buf;
+    const char *index_id;
+    index_func func;
+    index_record_func record_func;
+    read_filter_t filter;
+} read_stream_ctx_t;
+
+typedef void (*read_stream_func)(char *data, size_t len, read_stream_ctx_t *ctx);
+
+/**
+ * Decompress an index file and hand every output buffer to stream_func
+ */
+void read_index_stream(const char *path, index_descriptor_t *desc, read_stream_func stream_func,
+                       read_stream_ctx_t *ctx) {
 
     // Initialize zstd things
     FILE *file = fopen(path, "rb");
@@ -412,6 +1229,17 @@ void read_index_ndjson(const char *path, const char *index_id, index_func func)
 
     ZSTD_DCtx *const dctx = ZSTD_createDCtx();
 
+    void *dict = NULL;
+    if (*desc->compression_dict != '\0') {
+        size_t dict_size;
+        dict = read_index_dict(path, desc, &dict_size);
+        ZSTD_DCtx_loadDictionary(dctx, dict, dict_size);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t total_out = 0;
+
     size_t read;
     size_t last_ret = 0;
     while ((read = fread(buf_in, 1, buf_in_size, file))) {
@@ -422,18 +1250,14 @@ void read_index_ndjson(const char *path, const char *index_id, index_func func)
 
             size_t const ret = ZSTD_decompressStream(dctx, &output, &input);
 
-            for (int i = 0; i < output.pos; i++) {
-                char c = ((char *) output.dst)[i];
-
-                if (c == '\n') {
-                    dyn_buffer_write_char(&buf, '\0');
-                    read_index_bin_handle_line(buf.buf, index_id, func);
-                    buf.cur = 0;
-                } else {
-                    dyn_buffer_write_char(&buf, c);
-                }
+            if (ZSTD_isError(ret)) {
+                LOG_FATALF("serialize.c", "Could not decompress index file %s: %s", path, ZSTD_getErrorName(ret))
             }
 
+            total_out += output.pos;
+            // zstd keeps its window in its own buffer: stream_func may modify the output
+            stream_func(output.dst, output.pos, ctx);
+
             last_ret = ret;
         }
     }
@@ -446,73 +1270,494 @@ void read_index_ndjson(const char *path, const char *index_id, index_func func)
         LOG_FATALF("serialize.c", "EOF before end of stream: %zu", last_ret)
     }
 
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    LOG_DEBUGF("serialize.c", "Read %zukB from %s in %.2fs (%.1f MB/s, type=%s, dictionary=%d)",
+               total_out / 1024, path, elapsed, (double) total_out / 1e6 / MAX(elapsed, 1e-9),
+               desc->type, dict != NULL)
+
     ZSTD_freeDCtx(dctx);
     free(buf_in);
     free(buf_out);
+    if (dict != NULL) {
+        free(dict);
+    }
 
-    dyn_buffer_destroy(&buf);
     fclose(file);
 }
 
-void read_index(const char *path, const char index_id[MD5_STR_LENGTH], const char *type, index_func func) {
+static void read_index_ndjson_line(char *line, size_t len, const char *index_id, index_func func,
+                                   index_record_func record_func, const read_filter_t *filter) {
+    if (filter->tombstones != NULL) {
+        unsigned char path_md5[MD5_DIGEST_LENGTH];
+        ndjson_get_id(line, path_md5);
+        if (read_filter_skip(filter, path_md5)) {
+            return;
+        }
+    }
+    record_func(line, len, index_id, func);
+}
 
-    if (strcmp(type, INDEX_TYPE_NDJSON) == 0) {
-        read_index_ndjson(path, index_id, func);
+/**
+ * Call record_func for each complete line of data.
+ * Lines are terminated in place, without copying.
+ *
+ * @return number of bytes consumed
+ */
+size_t read_index_ndjson_lines(char *data, size_t len, const char *index_id, index_func func,
+                               index_record_func record_func, const read_filter_t *filter) {
+    char *line = data;
+    char *end = data + len;
+    char *newline;
+
+    while (line < end && (newline = memchr(line, '\n', end - line)) != NULL) {
+        *newline = '\0';
+        read_index_ndjson_line(line, newline - line, index_id, func, record_func, filter);
+        line = newline + 1;
     }
+
+    return line - data;
 }
 
-static __thread GHashTable *IncrementalReadTable = NULL;
+void read_index_ndjson_stream_func(char *data, size_t len, read_stream_ctx_t *ctx) {
 
-void json_put_incremental(cJSON *document, UNUSED(const char id_str[MD5_STR_LENGTH])) {
-    const char *path_md5_str = cJSON_GetObjectItem(document, "_id")->valuestring;
-    const int mtime = cJSON_GetObjectItem(document, "mtime")->valueint;
+    // Complete the line carried over from the previous output buffer
+    if (ctx->buf.cur != 0) {
+        char *newline = memchr(data, '\n', len);
+        if (newline == NULL) {
+            dyn_buffer_write(&ctx->buf, data, len);
+            return;
+        }
+
+        dyn_buffer_write(&ctx->buf, data, newline - data);
+        dyn_buffer_write_char(&ctx->buf, '\0');
+        read_index_ndjson_line(ctx->buf.buf, ctx->buf.cur - 1, ctx->index_id, ctx->func,
+                               ctx->record_func, &ctx->filter);
+        ctx->buf.cur = 0;
+
+        len -= newline + 1 - data;
+        data = newline + 1;
+    }
+
+    size_t consumed = read_index_ndjson_lines(data, len, ctx->index_id, ctx->func, ctx->record_func, &ctx->filter);
+
+    // Only the line that straddles two output buffers is copied
+    if (consumed < len) {
+        dyn_buffer_write(&ctx->buf, data + consumed, len - consumed);
+    }
+}
+
+void read_index_ndjson(const char *path, index_descriptor_t *desc, index_func func, index_record_func record_func) {
+    read_stream_ctx_t ctx = {
+            .buf = dyn_buffer_create(),
+            .index_id = desc->id,
+            .func = func,
+            .record_func = record_func,
+            .filter = read_index_filter(path),
+    };
+
+    read_index_stream(path, desc, read_index_ndjson_stream_func, &ctx);
+
+    dyn_buffer_destroy(&ctx.buf);
+}
+
+void read_index_bin_stream_func(char *data, size_t len, read_stream_ctx_t *ctx) {
+    dyn_buffer_write(&ctx->buf, data, len);
+    // Keep one spare byte after the last record for bin_add_string()
+    dyn_buffer_write_char(&ctx->buf, '\0');
+    ctx->buf.cur -= 1;
+
+    size_t consumed = read_index_bin_records(ctx->buf.buf, ctx->buf.cur, ctx->index_id,
+                                             ctx->func, ctx->record_func, &ctx->filter);
+
+    // Carry the incomplete record over to the next output buffer
+    memmove(ctx->buf.buf, ctx->buf.buf + consumed, ctx->buf.cur - consumed);
+    ctx->buf.cur -= consumed;
+}
+
+void read_index_bin(const char *path, index_descriptor_t *desc, index_func func, index_record_func record_func) {
+    read_stream_ctx_t ctx = {
+            .buf = dyn_buffer_create(),
+            .index_id = desc->id,
+            .func = func,
+            .record_func = record_func,
+            .filter = read_index_filter(path),
+    };
+
+    read_index_stream(path, desc, read_index_bin_stream_func, &ctx);
+
+    if (ctx.buf.cur != 0) {
+        LOG_FATALF("serialize.c", "Truncated record at the end of index file %s", path)
+    }
+    dyn_buffer_destroy(&ctx.buf);
+}
+
+void read_index(const char *path, index_descriptor_t *desc, index_func func) {
+
+    if (strcmp(desc->type, INDEX_TYPE_NDJSON) == 0) {
+        read_index_ndjson(path, desc, func, read_index_ndjson_handle_line);
+    } else if (strcmp(desc->type, INDEX_TYPE_BIN) == 0) {
+        read_index_bin(path, desc, func, read_index_bin_handle_record);
+    }
+}
+
+index_seek_table_t *read_index_seek_table(const char *path) {
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        LOG_FATALF("serialize.c", "Could not open index file %s: %s", path, strerror(errno))
+    }
+
+    unsigned char footer[ZSTD_SEEK_TABLE_FOOTER_SIZE];
+    if (fseek(file, -ZSTD_SEEK_TABLE_FOOTER_SIZE, SEEK_END) != 0 ||
+        fread(footer, 1, sizeof(footer), file) != sizeof(footer)) {
+        fclose(file);
+        return NULL;
+    }
+
+    uint32_t frame_count = le32toh(*(uint32_t *) footer);
+    uint8_t descriptor = footer[4];
+    uint32_t seekable_magic = le32toh(*(uint32_t *) (footer + 5));
+
+    if (seekable_magic != ZSTD_SEEKABLE_MAGIC) {
+        fclose(file);
+        return NULL;
+    }
+
+    // Bit 7 of the descriptor is the checksum flag
+    size_t entry_size = (descriptor & 0x80) ? 12 : 8;
+    size_t table_size = frame_count * entry_size;
+
+    unsigned char *table = malloc(table_size + 8);
+    if (fseek(file, -(long) (ZSTD_SEEK_TABLE_FOOTER_SIZE + table_size + 8), SEEK_END) != 0 ||
+        fread(table, 1, table_size + 8, file) != table_size + 8 ||
+        le32toh(*(uint32_t *) table) != ZSTD_SEEK_TABLE_SKIPPABLE_MAGIC) {
+        LOG_ERRORF("serialize.c", "Invalid seek table in index file %s", path)
+        free(table);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    index_seek_table_t *seek_table = malloc(sizeof(index_seek_table_t));
+    seek_table->frame_count = (int) frame_count;
+    seek_table->frames = malloc(sizeof(index_frame_t) * frame_count);
+
+    size_t offset = 0;
+    for (int i = 0; i < frame_count; i++) {
+        unsigned char *entry = table + 8 + i * entry_size;
+        seek_table->frames[i].offset = offset;
+        seek_table->frames[i].compressed_size = le32toh(*(uint32_t *) entry);
+        seek_table->frames[i].decompressed_size = le32toh(*(uint32_t *) (entry + 4));
+        offset += seek_table->frames[i].compressed_size;
+    }
+    free(table);
+
+    return seek_table;
+}
+
+void destroy_seek_table(index_seek_table_t *table) {
+    free(table->frames);
+    free(table);
+}
+
+typedef struct {
+    int fd;
+    const char *path;
+    index_descriptor_t *desc;
+    index_func func;
+    index_record_func record_func;
+    read_filter_t filter;
+    ZSTD_DDict *ddict;
+    index_frame_t frame;
+} read_frame_job_t;
+
+void read_index_frame_func(void *arg) {
+    read_frame_job_t *job = arg;
+
+    char *src = malloc(job->frame.compressed_size);
+    size_t ret = pread(job->fd, src, job->frame.compressed_size, (off_t) job->frame.offset);
+    if (ret != job->frame.compressed_size) {
+        LOG_FATALF("serialize.c", "Could not read frame at offset %zu of %s: %s",
+                   job->frame.offset, job->path, strerror(errno))
+    }
+
+    char *dst = malloc(job->frame.decompressed_size + 1);
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    size_t dst_len;
+    if (job->ddict != NULL) {
+        dst_len = ZSTD_decompress_usingDDict(dctx, dst, job->frame.decompressed_size,
+                                             src, job->frame.compressed_size, job->ddict);
+    } else {
+        dst_len = ZSTD_decompressDCtx(dctx, dst, job->frame.decompressed_size, src, job->frame.compressed_size);
+    }
+    ZSTD_freeDCtx(dctx);
+    free(src);
+
+    if (ZSTD_isError(dst_len)) {
+        LOG_FATALF("serialize.c", "Could not decompress frame at offset %zu of %s: %s",
+                   job->frame.offset, job->path, ZSTD_getErrorName(dst_len))
+    }
+
+    // Frames always start on a line (or record) boundary
+    if (strcmp(job->desc->type, INDEX_TYPE_BIN) == 0) {
+        size_t consumed = read_index_bin_records(dst, dst_len, job->desc->id, job->func,
+                                                  job->record_func, &job->filter);
+        if (consumed != dst_len) {
+            LOG_FATALF("serialize.c", "Truncated record in frame at offset %zu of %s", job->frame.offset, job->path)
+        }
+        free(dst);
+        return;
+    }
+
+    size_t consumed = read_index_ndjson_lines(dst, dst_len, job->desc->id, job->func,
+                                              job->record_func, &job->filter);
+    if (consumed < dst_len) {
+        // Last line without a trailing newline
+        dst[dst_len] = '\0';
+        read_index_ndjson_line(dst + consumed, dst_len - consumed, job->desc->id, job->func,
+                               job->record_func, &job->filter);
+    }
+
+    free(dst);
+}
+
+/**
+ * record_func receives the raw records of the index instead of the default
+ * cJSON conversion, it must match the index type.
+ */
+void read_index_parallel_records(const char *path, index_descriptor_t *desc, index_func func,
+                                 index_record_func record_func, int threads) {
+
+    int is_bin = strcmp(desc->type, INDEX_TYPE_BIN) == 0;
+    int is_ndjson = strcmp(desc->type, INDEX_TYPE_NDJSON) == 0;
+    if (record_func == NULL) {
+        record_func = is_bin ? read_index_bin_handle_record : read_index_ndjson_handle_line;
+    }
+
+    index_seek_table_t *seek_table = NULL;
+    if (threads > 1 && (is_bin || is_ndjson)) {
+        seek_table = read_index_seek_table(path);
+    }
+
+    if (seek_table == NULL || seek_table->frame_count <= 1) {
+        LOG_DEBUGF("serialize.c", "No seek table in %s, reading sequentially", path)
+        if (seek_table != NULL) {
+            destroy_seek_table(seek_table);
+        }
+        if (is_bin) {
+            read_index_bin(path, desc, func, record_func);
+        } else if (is_ndjson) {
+            read_index_ndjson(path, desc, func, record_func);
+        }
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOG_FATALF("serialize.c", "Could not open index file %s: %s", path, strerror(errno))
+    }
+
+    void *dict = NULL;
+    ZSTD_DDict *ddict = NULL;
+    if (*desc->compression_dict != '\0') {
+        size_t dict_size;
+        dict = read_index_dict(path, desc, &dict_size);
+        ddict = ZSTD_createDDict(dict, dict_size);
+    }
+
+    read_filter_t filter = read_index_filter(path);
+
+    tpool_t *pool = tpool_create(threads, read_index_thread_cleanup, TRUE, FALSE);
+    tpool_start(pool);
+
+    for (int i = 0; i < seek_table->frame_count; i++) {
+        read_frame_job_t *job = malloc(sizeof(read_frame_job_t));
+        job->fd = fd;
+        job->path = path;
+        job->desc = desc;
+        job->func = func;
+        job->record_func = record_func;
+        job->filter = filter;
+        job->ddict = ddict;
+        job->frame = seek_table->frames[i];
+
+        tpool_add_work(pool, read_index_frame_func, job);
+    }
+
+    tpool_wait(pool);
+    tpool_destroy(pool);
+
+    LOG_DEBUGF("serialize.c", "Read %d frames from %s with %d threads", seek_table->frame_count, path, threads)
+
+    if (ddict != NULL) {
+        ZSTD_freeDDict(ddict);
+        free(dict);
+    }
+    close(fd);
+    destroy_seek_table(seek_table);
+}
+
+void read_index_parallel(const char *path, index_descriptor_t *desc, index_func func, int threads) {
+    read_index_parallel_records(path, desc, func, NULL, threads);
+}
+
+static inc_table_t *IncrementalReadTable = NULL;
+static pthread_mutex_t IncrementalReadMu = PTHREAD_MUTEX_INITIALIZER;
+
+void bin_put_incremental(char *record, size_t len, UNUSED(const char *index_id), UNUSED(index_func func)) {
+    if (len < BIN_RECORD_HEADER_SIZE) {
+        LOG_FATALF("serialize.c", "Invalid binary index record (length=%zu)", len)
+    }
+    const int mtime = (int) bin_read_u32(record + MD5_DIGEST_LENGTH + 8);
+    const int flags = bin_record_has_parent(record, len) ? INC_TABLE_FLAG_PARENT : 0;
 
-    incremental_put_str(IncrementalReadTable, path_md5_str, mtime);
+    pthread_mutex_lock(&IncrementalReadMu);
+    inc_table_put(IncrementalReadTable, (unsigned char *) record, mtime, flags);
+    pthread_mutex_unlock(&IncrementalReadMu);
 }
 
-void incremental_read(GHashTable *table, const char *filepath, index_descriptor_t *desc) {
+void ndjson_put_incremental(char *line, UNUSED(size_t len), UNUSED(const char *index_id), UNUSED(index_func func)) {
+    unsigned char path_md5[MD5_DIGEST_LENGTH];
+    ndjson_get_id(line, path_md5);
+    const int mtime = ndjson_get_mtime(line);
+    const int flags = ndjson_find_value(line, NDJSON_PARENT_PATTERN) != NULL ? INC_TABLE_FLAG_PARENT : 0;
+
+    pthread_mutex_lock(&IncrementalReadMu);
+    inc_table_put(IncrementalReadTable, path_md5, mtime, flags);
+    pthread_mutex_unlock(&IncrementalReadMu);
+}
+
+void incremental_read(inc_table_t *table, const char *filepath, index_descriptor_t *desc, int threads) {
     IncrementalReadTable = table;
-    read_index(filepath, desc->id, desc->type, json_put_incremental);
+    // Only the _id & mtime are read from the raw records, without building a cJSON document
+    read_index_parallel_records(filepath, desc, NULL,
+                                strcmp(desc->type, INDEX_TYPE_BIN) == 0
+                                ? bin_put_incremental : ndjson_put_incremental,
+                                threads);
 }
 
-static __thread GHashTable *IncrementalCopyTable = NULL;
+static __thread inc_table_t *IncrementalCopyTable = NULL;
 static __thread store_t *IncrementalCopySourceStore = NULL;
 static __thread store_t *IncrementalCopyDestinationStore = NULL;
+static __thread dyn_buffer_t IncrementalCopyKeys = {0};
+static __thread size_t IncrementalCopyCount = 0;
 
-void incremental_copy_handle_doc(cJSON *document, UNUSED(const char id_str[MD5_STR_LENGTH])) {
+#define INCREMENTAL_COPY_BATCH_SIZE 4096
 
-    const char *path_md5_str = cJSON_GetObjectItem(document, "_id")->valuestring;
-    unsigned char path_md5[MD5_DIGEST_LENGTH];
-    hex2buf(path_md5_str, MD5_STR_LENGTH - 1, path_md5);
+static int md5_cmp(const void *a, const void *b) {
+    return memcmp(a, b, MD5_DIGEST_LENGTH);
+}
+
+/**
+ * Copy the thumbnails of the pending batch in key order, with a single
+ * transaction on each store
+ */
+void incremental_copy_flush_tn() {
+    size_t count = IncrementalCopyKeys.cur / MD5_DIGEST_LENGTH;
+    if (count == 0) {
+        return;
+    }
 
-    if (cJSON_GetObjectItem(document, "parent") != NULL || incremental_get_str(IncrementalCopyTable, path_md5_str)) {
-        // Copy index line
-        cJSON_DeleteItemFromObject(document, "index");
-        char *json_str = cJSON_PrintUnformatted(document);
-        const size_t json_str_len = strlen(json_str);
+    qsort(IncrementalCopyKeys.buf, count, MD5_DIGEST_LENGTH, md5_cmp);
+    store_copy_keys(IncrementalCopySourceStore, IncrementalCopyDestinationStore,
+                    IncrementalCopyKeys.buf, MD5_DIGEST_LENGTH, count);
+    IncrementalCopyKeys.cur = 0;
+}
 
-        json_str = realloc(json_str, json_str_len + 1);
-        *(json_str + json_str_len) = '\n';
+static int thumbnail_tiers_contain(const thumbnail_tiers_t *tiers, int size) {
+    for (int i = 0; i < tiers->count; i++) {
+        if (tiers->sizes[i] == size) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
 
-        zstd_write_string(json_str, json_str_len + 1);
-        free(json_str);
+void write_thumbnail_tier_keys(dyn_buffer_t *buf, const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    const thumbnail_tiers_t *tiers = &ScanCtx.index.desc.thumbnail_tiers;
+    const thumbnail_tiers_t *original_tiers = &ScanCtx.original_tiers;
+    unsigned char tier_key[MD5_DIGEST_LENGTH];
 
-        // Copy tn store contents
-        size_t buf_len;
-        char *buf = store_read(IncrementalCopySourceStore, (char *) path_md5, sizeof(path_md5), &buf_len);
-        if (buf_len != 0) {
-            store_write(IncrementalCopyDestinationStore, (char *) path_md5, sizeof(path_md5), buf, buf_len);
-            free(buf);
+    for (int i = 0; i < tiers->count; i++) {
+        thumbnail_tier_key(path_md5, tiers->sizes[i], tier_key);
+        dyn_buffer_write(buf, tier_key, MD5_DIGEST_LENGTH);
+    }
+    for (int i = 0; i < original_tiers->count; i++) {
+        if (!thumbnail_tiers_contain(tiers, original_tiers->sizes[i])) {
+            thumbnail_tier_key(path_md5, original_tiers->sizes[i], tier_key);
+            dyn_buffer_write(buf, tier_key, MD5_DIGEST_LENGTH);
         }
     }
 }
 
+void incremental_copy_tn(const unsigned char path_md5[MD5_DIGEST_LENGTH]) {
+    if (IncrementalCopyKeys.buf == NULL) {
+        IncrementalCopyKeys = dyn_buffer_create();
+    }
+
+    dyn_buffer_write(&IncrementalCopyKeys, path_md5, MD5_DIGEST_LENGTH);
+    IncrementalCopyCount += 1;
+
+    // Thumbnail tiers that are missing in the original index are skipped by store_copy_keys()
+    write_thumbnail_tier_keys(&IncrementalCopyKeys, path_md5);
+
+    if (IncrementalCopyKeys.cur >= INCREMENTAL_COPY_BATCH_SIZE * MD5_DIGEST_LENGTH) {
+        incremental_copy_flush_tn();
+    }
+}
+
 /**
- * Copy items from an index that are in the copy_table. Also copies from
+ * NDJSON lines are copied as-is, only the _id (and the fields of the
+ * manifest) are read
+ */
+void incremental_copy_handle_line(char *line, size_t len, UNUSED(const char *index_id), UNUSED(index_func func)) {
+    unsigned char path_md5[MD5_DIGEST_LENGTH];
+    ndjson_get_id(line, path_md5);
+
+    int has_parent = ndjson_find_value(line, NDJSON_PARENT_PATTERN) != NULL;
+    if (has_parent || inc_table_is_marked_for_copy(IncrementalCopyTable, path_md5)) {
+        const char *size = ndjson_find_value(line, NDJSON_SIZE_PATTERN);
+        manifest_add(path_md5, ndjson_get_mtime(line), size == NULL ? 0 : (uint64_t) strtod(size, NULL),
+                     has_parent ? MANIFEST_FLAG_PARENT : 0);
+
+        // Copy index line, line[len] is where the newline was
+        line[len] = '\n';
+        zstd_write_string(line, len + 1);
+        line[len] = '\0';
+
+        incremental_copy_tn(path_md5);
+    }
+}
+
+/**
+ * Binary records are copied as-is, without conversion to JSON
+ */
+void incremental_copy_handle_record(char *record, size_t len, UNUSED(const char *index_id), UNUSED(index_func func)) {
+    if (len < BIN_RECORD_HEADER_SIZE) {
+        LOG_FATALF("serialize.c", "Invalid binary index record (length=%zu)", len)
+    }
+    const unsigned char *path_md5 = (unsigned char *) record;
+
+    int has_parent = bin_record_has_parent(record, len);
+
+    if (has_parent || inc_table_is_marked_for_copy(IncrementalCopyTable, path_md5)) {
+        // Copy the record with its length prefix
+        zstd_write_string(record - sizeof(uint32_t), len + sizeof(uint32_t));
+        manifest_add(path_md5, (int) bin_read_u32(record + MD5_DIGEST_LENGTH + 8),
+                     bin_read_u64(record + MD5_DIGEST_LENGTH), has_parent ? MANIFEST_FLAG_PARENT : 0);
+        incremental_copy_tn(path_md5);
+    }
+}
+
+/**
+ * Copy items from an index that are marked for copy in copy_table. Also copies from
  * the store.
  */
 void incremental_copy(store_t *store, store_t *dst_store, const char *filepath,
-                      const char *dst_filepath, GHashTable *copy_table) {
+                      const char *dst_filepath, inc_table_t *copy_table, index_descriptor_t *desc) {
 
     if (WriterCtx.out_file == NULL) {
         initialize_writer_ctx(dst_filepath);
@@ -521,6 +1766,157 @@ void incremental_copy(store_t *store, store_t *dst_store, const char *filepath,
     IncrementalCopyTable = copy_table;
     IncrementalCopySourceStore = store;
     IncrementalCopyDestinationStore = dst_store;
+    IncrementalCopyCount = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (strcmp(desc->type, INDEX_TYPE_BIN) == 0) {
+        read_index_bin(filepath, desc, NULL, incremental_copy_handle_record);
+    } else {
+        read_index_ndjson(filepath, desc, NULL, incremental_copy_handle_line);
+    }
+    incremental_copy_flush_tn();
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    LOG_INFOF("serialize.c", "Copied %zu documents from %s in %.2fs (%.0f documents/s)",
+              IncrementalCopyCount, filepath, elapsed, (double) IncrementalCopyCount / MAX(elapsed, 1e-9))
+
+    if (IncrementalCopyKeys.buf != NULL) {
+        dyn_buffer_destroy(&IncrementalCopyKeys);
+        IncrementalCopyKeys.buf = NULL;
+    }
+}
+
+static size_t CompactCount;
+
+void compact_handle_line(char *line, size_t len, UNUSED(const char *index_id), UNUSED(index_func func)) {
+    line[len] = '\n';
+    zstd_write_string(line, len + 1);
+    line[len] = '\0';
+    CompactCount += 1;
+}
+
+void compact_handle_record(char *record, size_t len, UNUSED(const char *index_id), UNUSED(index_func func)) {
+    zstd_write_string(record - sizeof(uint32_t), len + sizeof(uint32_t));
+    CompactCount += 1;
+}
+
+/**
+ * The live records are written to a temporary file that replaces the index files
+ * once it is complete. If the process is interrupted before the old index
+ * files are removed, the index only contains duplicates.
+ */
+void index_compact_deltas(const char *index_path) {
+    char descriptor_path[PATH_MAX];
+    snprintf(descriptor_path, PATH_MAX, "%sdescriptor.json", index_path);
+    index_descriptor_t desc = read_index_descriptor(descriptor_path);
+
+    DIR *dir = opendir(index_path);
+    if (dir == NULL) {
+        LOG_FATALF("serialize.c", "Could not open index %s: %s", index_path, strerror(errno))
+    }
+
+    int index_file_count = 0;
+    int tombstones_count = 0;
+    int generation = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (is_index_file(de->d_name)) {
+            index_file_count += 1;
+        } else if (is_tombstones_file(de->d_name)) {
+            tombstones_count += 1;
+        } else {
+            continue;
+        }
+        generation = MAX(generation, index_file_generation(de->d_name));
+    }
+
+    if (tombstones_count == 0 && index_file_count <= 1) {
+        LOG_INFOF("serialize.c", "Index %s has no delta index files, nothing to compact", index_path)
+        closedir(dir);
+        return;
+    }
+
+    // The writer uses the scan context
+    ScanCtx.index.desc = desc;
+    strcpy(ScanCtx.index.path, index_path);
+    ScanCtx.compression_dict_samples = 0;
+    if (ScanCtx.index.desc.compression_frame_size == 0) {
+        // Index written before the frame size was recorded, use the scan default
+        ScanCtx.index.desc.compression_frame_size = 4096 * 1024;
+    }
+    writer_load_index_dict(index_path, &desc);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%scompact.tmp", index_path);
+    initialize_writer_ctx(tmp_path);
+
+    CompactCount = 0;
+    size_t size_before = 0;
+
+    rewinddir(dir);
+    while ((de = readdir(dir)) != NULL) {
+        if (!is_index_file(de->d_name) && !is_tombstones_file(de->d_name)) {
+            continue;
+        }
+
+        char file_path[PATH_MAX];
+        snprintf(file_path, PATH_MAX, "%s%s", index_path, de->d_name);
+
+        struct stat info;
+        if (stat(file_path, &info) == 0) {
+            size_before += info.st_size;
+        }
+
+        if (is_index_file(de->d_name)) {
+            if (strcmp(desc.type, INDEX_TYPE_BIN) == 0) {
+                read_index_bin(file_path, &desc, NULL, compact_handle_record);
+            } else {
+                read_index_ndjson(file_path, &desc, NULL, compact_handle_line);
+            }
+        }
+    }
+    writer_cleanup();
+
+    char dst_filename[PATH_MAX];
+    if (generation == 0) {
+        snprintf(dst_filename, PATH_MAX, "_index_main.%s.zst", desc.type);
+    } else {
+        snprintf(dst_filename, PATH_MAX, "_index_main_%d.%s.zst", generation, desc.type);
+    }
+    char dst_path[PATH_MAX];
+    snprintf(dst_path, PATH_MAX, "%s%s", index_path, dst_filename);
 
-    read_index(filepath, "", INDEX_TYPE_NDJSON, incremental_copy_handle_doc);
+    if (rename(tmp_path, dst_path) != 0) {
+        LOG_FATALF("serialize.c", "Could not rename %s: %s", tmp_path, strerror(errno))
+    }
+
+    // Tombstones are removed last, they still hide the old records until then
+    rewinddir(dir);
+    while ((de = readdir(dir)) != NULL) {
+        if (is_index_file(de->d_name) && strcmp(de->d_name, dst_filename) != 0) {
+            char file_path[PATH_MAX];
+            snprintf(file_path, PATH_MAX, "%s%s", index_path, de->d_name);
+            unlink(file_path);
+        }
+    }
+    rewinddir(dir);
+    while ((de = readdir(dir)) != NULL) {
+        if (is_tombstones_file(de->d_name)) {
+            char file_path[PATH_MAX];
+            snprintf(file_path, PATH_MAX, "%s%s", index_path, de->d_name);
+            unlink(file_path);
+        }
+    }
+    closedir(dir);
+    invalidate_tombstones();
+
+    struct stat info;
+    stat(dst_path, &info);
+    LOG_INFOF("serialize.c", "Compacted %d index files and %d tombstone files into %s (%zu documents, %zukB -> %zukB)",
+              index_file_count, tombstones_count, dst_filename, CompactCount, size_before / 1024,
+              (size_t) info.st_size / 1024)
 }
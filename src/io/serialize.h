@@ -3,20 +3,57 @@
 
 #include "src/sist.h"
 #include "store.h"
+#include "src/inc_table.h"
 
 #include <sys/syscall.h>
 #include <glib.h>
 
 typedef void(*index_func)(cJSON *, const char[MD5_STR_LENGTH]);
 
+typedef struct index_frame {
+    size_t offset;
+    size_t compressed_size;
+    size_t decompressed_size;
+} index_frame_t;
+
+typedef struct index_seek_table {
+    int frame_count;
+    index_frame_t *frames;
+} index_seek_table_t;
+
 void incremental_copy(store_t *store, store_t *dst_store, const char *filepath,
-                      const char *dst_filepath, GHashTable *copy_table);
+                      const char *dst_filepath, inc_table_t *copy_table, index_descriptor_t *desc);
 
 void write_document(document_t *doc);
 
-void read_index(const char *path, const char[MD5_STR_LENGTH], const char *type, index_func);
+/**
+ * Append the thumbnail tier keys of a document to buf, for the tiers of
+ * this scan and of the original index
+ */
+void write_thumbnail_tier_keys(dyn_buffer_t *buf, const unsigned char path_md5[MD5_DIGEST_LENGTH]);
+
+void read_index(const char *path, index_descriptor_t *desc, index_func);
+
+/**
+ * Read the frames of an index file with multiple threads. index_func
+ * must be thread safe. Falls back to read_index() for index files without
+ * a seek table.
+ */
+void read_index_parallel(const char *path, index_descriptor_t *desc, index_func, int threads);
 
-void incremental_read(GHashTable *table, const char *filepath, index_descriptor_t *desc);
+/**
+ * @return NULL if the index file has no seek table
+ */
+index_seek_table_t *read_index_seek_table(const char *path);
+
+void destroy_seek_table(index_seek_table_t *table);
+
+void incremental_read(inc_table_t *table, const char *filepath, index_descriptor_t *desc, int threads);
+
+/**
+ * Release the read transactions of the calling thread, see read_index_handle_document()
+ */
+void read_index_thread_cleanup();
 
 /**
  * Must be called after write_document
@@ -25,6 +62,34 @@ void thread_cleanup();
 
 void writer_cleanup();
 
+/**
+ * Compress the documents written after this call with the existing
+ * dictionary of the index instead of training a new one.
+ */
+void writer_load_index_dict(const char *index_path, index_descriptor_t *desc);
+
+/**
+ * _index_main.ndjson.zst -> 0, _index_delta_3.ndjson.zst -> 3, tombstones_3.bin -> 3
+ */
+int index_file_generation(const char *filename);
+
+/**
+ * @return generation of the next delta index file of the index
+ */
+int index_next_generation(const char *index_path);
+
+/**
+ * Documents of the index files with a lower generation are ignored by the
+ * readers.
+ */
+void write_index_tombstones(const char *index_path, int generation, const char *path_md5s, size_t count);
+
+/**
+ * Merge the delta index files and the tombstones of an index into a
+ * single index file.
+ */
+void index_compact_deltas(const char *index_path);
+
 void write_index_descriptor(char *path, index_descriptor_t *desc);
 
 index_descriptor_t read_index_descriptor(char *path);
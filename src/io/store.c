@@ -1,10 +1,15 @@
 #include "store.h"
 #include "src/ctx.h"
+#include "pack_store.h"
+
+static const store_ops_t LmdbStoreOps;
 
 store_t *store_create(const char *path, size_t chunk_size) {
     store_t *store = malloc(sizeof(struct store_t));
     mkdir(path, S_IWUSR | S_IRUSR | S_IXUSR);
     strcpy(store->path, path);
+    store->ops = &LmdbStoreOps;
+    store->backend = NULL;
 
 #if (SIST_FAKE_STORE != 1)
     store->chunk_size = chunk_size;
@@ -12,9 +17,10 @@ store_t *store_create(const char *path, size_t chunk_size) {
 
     mdb_env_create(&store->env);
 
+    // MDB_NOTLS: the read transaction of store_read_begin() is not bound to a thread
     int open_ret = mdb_env_open(store->env,
                                 path,
-                                MDB_WRITEMAP | MDB_MAPASYNC,
+                                MDB_WRITEMAP | MDB_MAPASYNC | MDB_NOTLS,
                                 S_IRUSR | S_IWUSR
     );
 
@@ -22,9 +28,32 @@ store_t *store_create(const char *path, size_t chunk_size) {
         LOG_FATALF("store.c", "Error while opening store: %s (%s)\n", mdb_strerror(open_ret), path)
     }
 
+    store->writer_started = FALSE;
+    store->writer_stop = FALSE;
+    pthread_mutex_init(&store->queue_mu, NULL);
+    pthread_cond_init(&store->queue_cond, NULL);
+    pthread_cond_init(&store->queue_space_cond, NULL);
+    store->queue_head = NULL;
+    store->queue_tail = NULL;
+    store->queue_size = 0;
+    store->write_count = 0;
+    store->batch_count = 0;
+    store->growth_cap = STORE_GROWTH_CAP;
+    store->read_txn = NULL;
+    store->resize_count = 0;
+    store->resize_time = 0;
+    store->content_table = NULL;
+    store->dedup_count = 0;
+    store->dedup_size = 0;
+
     store->size = (size_t) store->chunk_size;
     mdb_env_set_mapsize(store->env, store->size);
 
+    // The map of an existing store can be larger than chunk_size
+    MDB_envinfo info;
+    mdb_env_info(store->env, &info);
+    store->size = info.me_mapsize;
+
     // Open dbi
     MDB_txn *txn;
     mdb_txn_begin(store->env, NULL, 0, &txn);
@@ -35,9 +64,22 @@ store_t *store_create(const char *path, size_t chunk_size) {
     return store;
 }
 
-void store_destroy(store_t *store) {
+static void store_stop_writer(store_t *store);
+
+static void lmdb_store_destroy(store_t *store) {
 
 #if (SIST_FAKE_STORE != 1)
+    store_stop_writer(store);
+    if (store->resize_count > 0) {
+        LOG_INFOF("store.c", "Resized %s %d times in %.3fs (mapsize=%zuMB)",
+                  store->path, store->resize_count, store->resize_time, store->size / (1024 * 1024))
+    }
+    if (store->read_txn != NULL) {
+        mdb_txn_abort(store->read_txn);
+    }
+    pthread_mutex_destroy(&store->queue_mu);
+    pthread_cond_destroy(&store->queue_cond);
+    pthread_cond_destroy(&store->queue_space_cond);
     pthread_rwlock_destroy(&store->lock);
     mdb_dbi_close(store->env, store->dbi);
     mdb_env_close(store->env);
@@ -45,11 +87,235 @@ void store_destroy(store_t *store) {
     free(store);
 }
 
-void store_flush(store_t *store) {
+/**
+ * Grow the map geometrically, by at most growth_cap bytes. full_size is the
+ * size of the map when MDB_MAP_FULL was returned: if another thread already
+ * resized it, nothing is done. Must be called without an opened transaction.
+ */
+static void store_increase_mapsize(store_t *store, size_t full_size) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_wrlock(&store->lock);
+    if (store->size != full_size) {
+        pthread_rwlock_unlock(&store->lock);
+        return;
+    }
+
+    store->size += MIN(MAX(store->size, store->chunk_size), store->growth_cap);
+    int resize_ret = mdb_env_set_mapsize(store->env, store->size);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    store->resize_count += 1;
+    store->resize_time += (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    pthread_rwlock_unlock(&store->lock);
+
+    if (resize_ret != 0) {
+        LOG_FATALF("store.c", "Could not resize store %s: %s", store->path, mdb_strerror(resize_ret))
+    }
+    LOG_DEBUGF("store.c", "Updated mdb mapsize of %s to %lu bytes", store->path, store->size)
+}
+
+void store_reserve(store_t *store, size_t size) {
+
+#if (SIST_FAKE_STORE != 1)
+    if (store->ops != &LmdbStoreOps) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&store->lock);
+    if (size > store->size) {
+        int ret = mdb_env_set_mapsize(store->env, size);
+        if (ret == 0) {
+            store->size = size;
+            LOG_INFOF("store.c", "Reserved %zuMB for store %s", size / (1024 * 1024), store->path)
+        } else {
+            LOG_WARNINGF("store.c", "Could not reserve %zu bytes for store %s: %s", size, store->path,
+                         mdb_strerror(ret))
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+#endif
+}
+
+/**
+ * Begin a write transaction, must be called with the read lock held
+ */
+static MDB_txn *store_begin_write_txn(store_t *store) {
+    MDB_txn *txn;
+    int ret = mdb_txn_begin(store->env, NULL, 0, &txn);
+    if (ret != 0) {
+        pthread_rwlock_unlock(&store->lock);
+        LOG_FATALF("store.c", "Could not begin transaction on store %s: %s", store->path, mdb_strerror(ret))
+    }
+    return txn;
+}
+
+/**
+ * Commit a batch of writes in one transaction. When the map is full,
+ * it is resized once and the whole batch is retried.
+ */
+static void store_commit_batch(store_t *store, store_write_op_t *ops) {
+
+    while (TRUE) {
+        size_t batch_size = 0;
+
+        pthread_rwlock_rdlock(&store->lock);
+        size_t size = store->size;
+        MDB_txn *txn = store_begin_write_txn(store);
+
+        int ret = 0;
+        for (store_write_op_t *op = ops; op != NULL && ret == 0; op = op->next) {
+            MDB_val mdb_key;
+            mdb_key.mv_data = op->data;
+            mdb_key.mv_size = op->key_len;
+
+            MDB_val mdb_value;
+            mdb_value.mv_data = op->data + op->key_len;
+            mdb_value.mv_size = op->buf_len;
+
+            ret = mdb_put(txn, store->dbi, &mdb_key, &mdb_value, 0);
+            batch_size += op->buf_len;
+        }
+
+        if (ret == 0) {
+            ret = mdb_txn_commit(txn);
+        } else {
+            mdb_txn_abort(txn);
+        }
+        pthread_rwlock_unlock(&store->lock);
+
+        if (ret == MDB_MAP_FULL) {
+            store_increase_mapsize(store, size);
+            continue;
+        }
+
+        if (ret != 0) {
+            LOG_FATALF("store.c", "Could not commit to store %s: %s", store->path, mdb_strerror(ret))
+        }
+
+        __atomic_fetch_add(&ScanCtx.stat_tn_size, batch_size, __ATOMIC_RELAXED);
+        break;
+    }
+}
+
+static void *store_writer_main(void *arg) {
+    store_t *store = arg;
+
+    pthread_mutex_lock(&store->queue_mu);
+    while (TRUE) {
+        while (store->queue_head == NULL && !store->writer_stop) {
+            pthread_cond_wait(&store->queue_cond, &store->queue_mu);
+        }
+        if (store->queue_head == NULL) {
+            break;
+        }
+
+        // Wait for a full batch, at most STORE_BATCH_DELAY_MS after the first write
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) STORE_BATCH_DELAY_MS * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        while (store->queue_size < STORE_BATCH_SIZE && !store->writer_stop) {
+            if (pthread_cond_timedwait(&store->queue_cond, &store->queue_mu, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        store_write_op_t *ops = store->queue_head;
+        store->queue_head = NULL;
+        store->queue_tail = NULL;
+        store->queue_size = 0;
+        pthread_cond_broadcast(&store->queue_space_cond);
+        pthread_mutex_unlock(&store->queue_mu);
+
+        store_commit_batch(store, ops);
+
+        size_t count = 0;
+        while (ops != NULL) {
+            store_write_op_t *next = ops->next;
+            free(ops);
+            ops = next;
+            count += 1;
+        }
+
+        pthread_mutex_lock(&store->queue_mu);
+        store->write_count += count;
+        store->batch_count += 1;
+    }
+    pthread_mutex_unlock(&store->queue_mu);
+
+    return NULL;
+}
+
+static void store_stop_writer(store_t *store) {
+    if (!store->writer_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&store->queue_mu);
+    store->writer_stop = TRUE;
+    pthread_cond_signal(&store->queue_cond);
+    pthread_mutex_unlock(&store->queue_mu);
+
+    pthread_join(store->writer_thread, NULL);
+    store->writer_started = FALSE;
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double) (end.tv_sec - store->writer_start.tv_sec) +
+                     (double) (end.tv_nsec - store->writer_start.tv_nsec) / 1e9;
+
+    LOG_INFOF("store.c", "Wrote %zu entries to %s in %zu batches (%.0f entries/s)",
+              store->write_count, store->path, store->batch_count,
+              (double) store->write_count / MAX(elapsed, 1e-9))
+}
+
+static void lmdb_store_write_async(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len) {
+
+#if (SIST_FAKE_STORE != 1)
+    store_write_op_t *op = malloc(sizeof(store_write_op_t) + key_len + buf_len);
+    op->next = NULL;
+    op->key_len = key_len;
+    op->buf_len = buf_len;
+    memcpy(op->data, key, key_len);
+    memcpy(op->data + key_len, buf, buf_len);
+
+    pthread_mutex_lock(&store->queue_mu);
+
+    if (!store->writer_started) {
+        clock_gettime(CLOCK_MONOTONIC, &store->writer_start);
+        store->writer_stop = FALSE;
+        pthread_create(&store->writer_thread, NULL, store_writer_main, store);
+        store->writer_started = TRUE;
+    }
+
+    // Bound the memory used by the pending writes
+    while (store->queue_size >= STORE_QUEUE_MAX_SIZE) {
+        pthread_cond_wait(&store->queue_space_cond, &store->queue_mu);
+    }
+
+    if (store->queue_tail == NULL) {
+        store->queue_head = op;
+    } else {
+        store->queue_tail->next = op;
+    }
+    store->queue_tail = op;
+    store->queue_size += key_len + buf_len;
+
+    pthread_cond_signal(&store->queue_cond);
+    pthread_mutex_unlock(&store->queue_mu);
+#endif
+}
+
+static void lmdb_store_flush(store_t *store) {
     mdb_env_sync(store->env, TRUE);
 }
 
-void store_write(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len) {
+static void lmdb_store_write(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len) {
 
     if (LogCtx.very_verbose) {
         if (key_len == MD5_DIGEST_LENGTH) {
@@ -71,68 +337,37 @@ void store_write(store_t *store, char *key, size_t key_len, char *buf, size_t bu
     mdb_value.mv_data = buf;
     mdb_value.mv_size = buf_len;
 
-    MDB_txn *txn;
-    pthread_rwlock_rdlock(&store->lock);
-    mdb_txn_begin(store->env, NULL, 0, &txn);
-
-    int put_ret = mdb_put(txn, store->dbi, &mdb_key, &mdb_value, 0);
-    ScanCtx.stat_tn_size += buf_len;
-
-    int db_full = FALSE;
-    int should_abort_transaction = FALSE;
-
-    if (put_ret == MDB_MAP_FULL) {
-        db_full = TRUE;
-        should_abort_transaction = TRUE;
-    } else {
-        int commit_ret = mdb_txn_commit(txn);
+    while (TRUE) {
+        pthread_rwlock_rdlock(&store->lock);
+        size_t size = store->size;
+        MDB_txn *txn = store_begin_write_txn(store);
 
-        if (commit_ret == MDB_MAP_FULL) {
-            db_full = TRUE;
-        }
-    }
-
-    if (db_full) {
-        LOG_INFOF("store.c", "Updating mdb mapsize to %lu bytes", store->size)
-
-        if (should_abort_transaction) {
+        int ret = mdb_put(txn, store->dbi, &mdb_key, &mdb_value, 0);
+        if (ret == 0) {
+            ret = mdb_txn_commit(txn);
+        } else {
             mdb_txn_abort(txn);
         }
-
         pthread_rwlock_unlock(&store->lock);
 
-        // Cannot resize when there is a opened transaction.
-        //  Resize take effect on the next commit.
-        pthread_rwlock_wrlock(&store->lock);
-        store->size += store->chunk_size;
-        int resize_ret = mdb_env_set_mapsize(store->env, store->size);
-        if (resize_ret != 0) {
-            LOG_ERROR("store.c", mdb_strerror(put_ret))
-        }
-        mdb_txn_begin(store->env, NULL, 0, &txn);
-        int put_ret_retry = mdb_put(txn, store->dbi, &mdb_key, &mdb_value, 0);
-
-        if (put_ret_retry != 0) {
-            LOG_ERROR("store.c", mdb_strerror(put_ret))
+        if (ret == MDB_MAP_FULL) {
+            // Cannot resize when there is a opened transaction
+            store_increase_mapsize(store, size);
+            continue;
         }
 
-        int ret = mdb_txn_commit(txn);
         if (ret != 0) {
-            LOG_FATALF("store.c", "FIXME: Could not commit to store %s: %s (%d), %d, %d %d",
-                       store->path, mdb_strerror(ret), ret,
-                       put_ret, put_ret_retry);
+            LOG_ERROR("store.c", mdb_strerror(ret))
+        } else {
+            __atomic_fetch_add(&ScanCtx.stat_tn_size, buf_len, __ATOMIC_RELAXED);
         }
-        LOG_INFOF("store.c", "Updated mdb mapsize to %lu bytes", store->size)
-    } else if (put_ret != 0) {
-        LOG_ERROR("store.c", mdb_strerror(put_ret))
+        break;
     }
 
-    pthread_rwlock_unlock(&store->lock);
-
 #endif
 }
 
-char *store_read(store_t *store, char *key, size_t key_len, size_t *ret_vallen) {
+static char *lmdb_store_read(store_t *store, char *key, size_t key_len, size_t *ret_vallen) {
     char *buf = NULL;
 
 #if (SIST_FAKE_STORE != 1)
@@ -160,7 +395,79 @@ char *store_read(store_t *store, char *key, size_t key_len, size_t *ret_vallen)
     return buf;
 }
 
-GHashTable *store_read_all(store_t *store) {
+const char *store_txn_read(store_t *store, MDB_txn **txn, const char *key, size_t key_len, size_t *ret_vallen) {
+    *ret_vallen = 0;
+
+#if (SIST_FAKE_STORE != 1)
+    // Renewing a reset transaction reuses its reader slot
+    int ret;
+    if (*txn == NULL) {
+        ret = mdb_txn_begin(store->env, NULL, MDB_RDONLY, txn);
+    } else {
+        ret = mdb_txn_renew(*txn);
+    }
+
+    if (ret != 0) {
+        LOG_ERRORF("store.c", "Could not begin read transaction on %s: %s", store->path, mdb_strerror(ret))
+        if (*txn != NULL) {
+            mdb_txn_abort(*txn);
+            *txn = NULL;
+        }
+        return NULL;
+    }
+
+    MDB_val mdb_key;
+    mdb_key.mv_data = (void *) key;
+    mdb_key.mv_size = key_len;
+
+    MDB_val mdb_value;
+    if (mdb_get(*txn, store->dbi, &mdb_key, &mdb_value) != 0) {
+        return NULL;
+    }
+
+    *ret_vallen = mdb_value.mv_size;
+    return mdb_value.mv_data;
+#else
+    return NULL;
+#endif
+}
+
+void store_txn_reset(MDB_txn *txn) {
+#if (SIST_FAKE_STORE != 1)
+    if (txn != NULL) {
+        // Release the snapshot but keep the reader slot
+        mdb_txn_reset(txn);
+    }
+#endif
+}
+
+void store_txn_close(MDB_txn *txn) {
+#if (SIST_FAKE_STORE != 1)
+    if (txn != NULL) {
+        mdb_txn_abort(txn);
+    }
+#endif
+}
+
+static const char *lmdb_store_read_begin(store_t *store, const char *key, size_t key_len, size_t *ret_vallen) {
+    return store_txn_read(store, &store->read_txn, key, key_len, ret_vallen);
+}
+
+static void lmdb_store_read_end(store_t *store) {
+    store_txn_reset(store->read_txn);
+}
+
+static size_t lmdb_store_count(store_t *store) {
+#if (SIST_FAKE_STORE != 1)
+    MDB_stat stat;
+    mdb_env_stat(store->env, &stat);
+    return stat.ms_entries;
+#else
+    return 0;
+#endif
+}
+
+static GHashTable *lmdb_store_read_all(store_t *store) {
 
     int count = 0;
 
@@ -194,8 +501,504 @@ GHashTable *store_read_all(store_t *store) {
     return table;
 }
 
+static void lmdb_store_copy_keys(store_t *store, store_t *dst_store, const char *keys, size_t key_len,
+                                 size_t key_count, dyn_buffer_t *refs) {
 
-void store_copy(store_t *store, const char *destination) {
+#if (SIST_FAKE_STORE != 1)
+    MDB_txn *src_txn;
+    mdb_txn_begin(store->env, NULL, MDB_RDONLY, &src_txn);
+
+    MDB_cursor *cur;
+    mdb_cursor_open(src_txn, store->dbi, &cur);
+
+    size_t refs_start = refs == NULL ? 0 : refs->cur;
+
+    while (TRUE) {
+        size_t copied_count = 0;
+        size_t copied_size = 0;
+        if (refs != NULL) {
+            refs->cur = refs_start;
+        }
+
+        pthread_rwlock_rdlock(&dst_store->lock);
+        size_t size = dst_store->size;
+        MDB_txn *txn = store_begin_write_txn(dst_store);
+
+        int ret = 0;
+        for (size_t i = 0; i < key_count && ret == 0; i++) {
+            MDB_val mdb_key;
+            mdb_key.mv_data = (void *) (keys + i * key_len);
+            mdb_key.mv_size = key_len;
+
+            MDB_val mdb_value;
+            if (mdb_cursor_get(cur, &mdb_key, &mdb_value, MDB_SET_KEY) != 0) {
+                continue;
+            }
+
+            ret = mdb_put(txn, dst_store->dbi, &mdb_key, &mdb_value, 0);
+            copied_count += 1;
+            copied_size += mdb_value.mv_size;
+
+            if (refs != NULL && store_is_ref(mdb_value.mv_data, mdb_value.mv_size)) {
+                dyn_buffer_write(refs, (char *) mdb_value.mv_data + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+            }
+        }
+
+        if (ret == 0) {
+            ret = mdb_txn_commit(txn);
+        } else {
+            mdb_txn_abort(txn);
+        }
+        pthread_rwlock_unlock(&dst_store->lock);
+
+        if (ret == MDB_MAP_FULL) {
+            // Cannot resize when there is a opened transaction, retry the whole batch
+            store_increase_mapsize(dst_store, size);
+            continue;
+        }
+
+        if (ret != 0) {
+            LOG_FATALF("store.c", "Could not copy to store %s: %s", dst_store->path, mdb_strerror(ret))
+        }
+
+        __atomic_fetch_add(&ScanCtx.stat_tn_size, copied_size, __ATOMIC_RELAXED);
+        LOG_DEBUGF("store.c", "Copied %zu/%zu entries (%zukB) to %s",
+                   copied_count, key_count, copied_size / 1024, dst_store->path)
+        break;
+    }
+
+    mdb_cursor_close(cur);
+    mdb_txn_abort(src_txn);
+#endif
+}
+
+static void lmdb_store_delete_keys(store_t *store, const char *keys, size_t key_len, size_t key_count) {
+
+#if (SIST_FAKE_STORE != 1)
+    pthread_rwlock_rdlock(&store->lock);
+    MDB_txn *txn = store_begin_write_txn(store);
+
+    size_t deleted_count = 0;
+    for (size_t i = 0; i < key_count; i++) {
+        MDB_val mdb_key;
+        mdb_key.mv_data = (void *) (keys + i * key_len);
+        mdb_key.mv_size = key_len;
+
+        if (mdb_del(txn, store->dbi, &mdb_key, NULL) == 0) {
+            deleted_count += 1;
+        }
+    }
+
+    int ret = mdb_txn_commit(txn);
+    pthread_rwlock_unlock(&store->lock);
+
+    if (ret != 0) {
+        LOG_FATALF("store.c", "Could not delete from store %s: %s", store->path, mdb_strerror(ret))
+    }
+    LOG_DEBUGF("store.c", "Deleted %zu/%zu entries from %s", deleted_count, key_count, store->path)
+#endif
+}
+
+static void lmdb_store_read_refs(store_t *store, dyn_buffer_t *refs) {
+
+#if (SIST_FAKE_STORE != 1)
+    // Commit the pending writes
+    store_stop_writer(store);
+
+    MDB_txn *txn;
+    mdb_txn_begin(store->env, NULL, MDB_RDONLY, &txn);
+
+    MDB_cursor *cur;
+    mdb_cursor_open(txn, store->dbi, &cur);
+
+    MDB_val key;
+    MDB_val value;
+    while (mdb_cursor_get(cur, &key, &value, MDB_NEXT) == 0) {
+        if (store_is_ref(value.mv_data, value.mv_size)) {
+            dyn_buffer_write(refs, (char *) value.mv_data + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+        }
+    }
+
+    mdb_cursor_close(cur);
+    mdb_txn_abort(txn);
+#endif
+}
+
+static void lmdb_store_copy(store_t *store, const char *destination) {
     mkdir(destination, S_IWUSR | S_IRUSR | S_IXUSR);
     mdb_env_copy(store->env, destination);
 }
+
+static const store_ops_t LmdbStoreOps = {
+        .name = STORE_BACKEND_LMDB,
+        .destroy = lmdb_store_destroy,
+        .write = lmdb_store_write,
+        .write_async = lmdb_store_write_async,
+        .flush = lmdb_store_flush,
+        .read = lmdb_store_read,
+        .read_begin = lmdb_store_read_begin,
+        .read_end = lmdb_store_read_end,
+        .read_all = lmdb_store_read_all,
+        .count = lmdb_store_count,
+        .copy_keys = lmdb_store_copy_keys,
+        .delete_keys = lmdb_store_delete_keys,
+        .copy = lmdb_store_copy,
+        .read_refs = lmdb_store_read_refs,
+};
+
+store_t *store_open(const char *path, size_t chunk_size, const char *backend) {
+    if (pack_store_exists(path)) {
+        return pack_store_create(path);
+    }
+
+    char lmdb_path[PATH_MAX];
+    snprintf(lmdb_path, PATH_MAX, "%s/data.mdb", path);
+    if (access(lmdb_path, F_OK) != 0 && strcmp(backend, STORE_BACKEND_PACK) == 0) {
+        return pack_store_create(path);
+    }
+
+    return store_create(path, chunk_size);
+}
+
+static int content_md5_cmp(const void *a, const void *b) {
+    return memcmp(a, b, MD5_DIGEST_LENGTH);
+}
+
+static guint content_md5_hash(gconstpointer key) {
+    guint hash;
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean content_md5_equal(gconstpointer a, gconstpointer b) {
+    return memcmp(a, b, MD5_DIGEST_LENGTH) == 0;
+}
+
+/**
+ * @return table of the content md5 of the references in the store
+ */
+static GHashTable *store_read_ref_table(store_t *store) {
+    GHashTable *table = g_hash_table_new_full(content_md5_hash, content_md5_equal, free, NULL);
+
+    dyn_buffer_t refs = dyn_buffer_create();
+    store->ops->read_refs(store, &refs);
+
+    for (size_t i = 0; i < refs.cur / MD5_DIGEST_LENGTH; i++) {
+        const char *content_md5 = refs.buf + i * MD5_DIGEST_LENGTH;
+        if (!g_hash_table_contains(table, content_md5)) {
+            char *key = malloc(MD5_DIGEST_LENGTH);
+            memcpy(key, content_md5, MD5_DIGEST_LENGTH);
+            g_hash_table_add(table, key);
+        }
+    }
+    dyn_buffer_destroy(&refs);
+
+    return table;
+}
+
+void store_enable_dedup(store_t *store) {
+    // The referenced values of a reopened store are already written
+    store->content_table = store_read_ref_table(store);
+    pthread_mutex_init(&store->content_mu, NULL);
+    store->dedup_count = 0;
+    store->dedup_size = 0;
+
+    LOG_DEBUGF("store.c", "Loaded %u deduplicated values from %s",
+               g_hash_table_size(store->content_table), store->path)
+}
+
+size_t store_delete_unreferenced(store_t *store) {
+    GHashTable *referenced = store_read_ref_table(store);
+    dyn_buffer_t unreferenced = dyn_buffer_create();
+
+    pthread_mutex_lock(&store->content_mu);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, store->content_table);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(referenced, key)) {
+            dyn_buffer_write(&unreferenced, key, MD5_DIGEST_LENGTH);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    pthread_mutex_unlock(&store->content_mu);
+
+    size_t count = unreferenced.cur / MD5_DIGEST_LENGTH;
+    if (count > 0) {
+        qsort(unreferenced.buf, count, MD5_DIGEST_LENGTH, content_md5_cmp);
+        store->ops->delete_keys(store, unreferenced.buf, MD5_DIGEST_LENGTH, count);
+    }
+
+    dyn_buffer_destroy(&unreferenced);
+    g_hash_table_destroy(referenced);
+
+    return count;
+}
+
+int store_is_ref(const char *value, size_t value_len) {
+    return value_len == STORE_REF_SIZE && memcmp(value, STORE_REF_MAGIC, STORE_REF_MAGIC_SIZE) == 0;
+}
+
+/**
+ * @return TRUE if the content md5 was not in the content table
+ */
+static int store_add_content(store_t *store, const char *content_md5) {
+    pthread_mutex_lock(&store->content_mu);
+    int is_new = !g_hash_table_contains(store->content_table, content_md5);
+    if (is_new) {
+        char *key = malloc(MD5_DIGEST_LENGTH);
+        memcpy(key, content_md5, MD5_DIGEST_LENGTH);
+        g_hash_table_add(store->content_table, key);
+    }
+    pthread_mutex_unlock(&store->content_mu);
+
+    return is_new;
+}
+
+static void store_write_dedup(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len,
+                              void (*write_func)(store_t *, char *, size_t, char *, size_t)) {
+    char ref[STORE_REF_SIZE];
+    memcpy(ref, STORE_REF_MAGIC, STORE_REF_MAGIC_SIZE);
+    MD5((unsigned char *) buf, buf_len, (unsigned char *) ref + STORE_REF_MAGIC_SIZE);
+
+    if (store_add_content(store, ref + STORE_REF_MAGIC_SIZE)) {
+        write_func(store, ref + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH, buf, buf_len);
+    } else {
+        __atomic_fetch_add(&store->dedup_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&store->dedup_size, buf_len, __ATOMIC_RELAXED);
+    }
+
+    write_func(store, key, key_len, ref, STORE_REF_SIZE);
+}
+
+void store_destroy(store_t *store) {
+    if (store->content_table != NULL) {
+        g_hash_table_destroy(store->content_table);
+        pthread_mutex_destroy(&store->content_mu);
+    }
+    store->ops->destroy(store);
+}
+
+void store_write(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len) {
+    if (store->content_table != NULL) {
+        store_write_dedup(store, key, key_len, buf, buf_len, store->ops->write);
+        return;
+    }
+    store->ops->write(store, key, key_len, buf, buf_len);
+}
+
+void store_write_async(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len) {
+    if (store->content_table != NULL) {
+        store_write_dedup(store, key, key_len, buf, buf_len, store->ops->write_async);
+        return;
+    }
+    store->ops->write_async(store, key, key_len, buf, buf_len);
+}
+
+void store_flush(store_t *store) {
+    store->ops->flush(store);
+}
+
+char *store_read(store_t *store, char *key, size_t key_len, size_t *ret_vallen) {
+    char *value = store->ops->read(store, key, key_len, ret_vallen);
+
+    if (value != NULL && store_is_ref(value, *ret_vallen)) {
+        char content_md5[MD5_DIGEST_LENGTH];
+        memcpy(content_md5, value + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+        free(value);
+        value = store->ops->read(store, content_md5, MD5_DIGEST_LENGTH, ret_vallen);
+    }
+    return value;
+}
+
+const char *store_read_begin(store_t *store, const char *key, size_t key_len, size_t *ret_vallen) {
+    const char *value = store->ops->read_begin(store, key, key_len, ret_vallen);
+
+    if (value != NULL && store_is_ref(value, *ret_vallen)) {
+        char content_md5[MD5_DIGEST_LENGTH];
+        memcpy(content_md5, value + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+        store->ops->read_end(store);
+        value = store->ops->read_begin(store, content_md5, MD5_DIGEST_LENGTH, ret_vallen);
+    }
+    return value;
+}
+
+void store_read_end(store_t *store) {
+    store->ops->read_end(store);
+}
+
+GHashTable *store_read_all(store_t *store) {
+    return store->ops->read_all(store);
+}
+
+size_t store_count(store_t *store) {
+    return store->ops->count(store);
+}
+
+void store_copy_keys(store_t *store, store_t *dst_store, const char *keys, size_t key_len, size_t key_count) {
+    dyn_buffer_t refs = dyn_buffer_create();
+
+    if (store->ops == dst_store->ops) {
+        store->ops->copy_keys(store, dst_store, keys, key_len, key_count, &refs);
+    } else {
+        // Different backends
+        for (size_t i = 0; i < key_count; i++) {
+            size_t value_len;
+            char *key = (char *) (keys + i * key_len);
+            char *value = store->ops->read(store, key, key_len, &value_len);
+            if (value != NULL) {
+                dst_store->ops->write_async(dst_store, key, key_len, value, value_len);
+                if (store_is_ref(value, value_len)) {
+                    dyn_buffer_write(&refs, value + STORE_REF_MAGIC_SIZE, MD5_DIGEST_LENGTH);
+                }
+                free(value);
+            }
+        }
+    }
+
+    // Copy the deduplicated values that are not in dst_store yet
+    size_t ref_count = refs.cur / MD5_DIGEST_LENGTH;
+    if (ref_count > 0) {
+        qsort(refs.buf, ref_count, MD5_DIGEST_LENGTH, content_md5_cmp);
+
+        size_t new_count = 0;
+        for (size_t i = 0; i < ref_count; i++) {
+            char *content_md5 = refs.buf + i * MD5_DIGEST_LENGTH;
+            if (dst_store->content_table != NULL && !store_add_content(dst_store, content_md5)) {
+                continue;
+            }
+            if (new_count > 0 && memcmp(refs.buf + (new_count - 1) * MD5_DIGEST_LENGTH, content_md5,
+                                        MD5_DIGEST_LENGTH) == 0) {
+                continue;
+            }
+            memmove(refs.buf + new_count * MD5_DIGEST_LENGTH, content_md5, MD5_DIGEST_LENGTH);
+            new_count += 1;
+        }
+
+        if (store->ops == dst_store->ops) {
+            store->ops->copy_keys(store, dst_store, refs.buf, MD5_DIGEST_LENGTH, new_count, NULL);
+        } else {
+            for (size_t i = 0; i < new_count; i++) {
+                size_t value_len;
+                char *value = store->ops->read(store, refs.buf + i * MD5_DIGEST_LENGTH, MD5_DIGEST_LENGTH,
+                                               &value_len);
+                if (value != NULL) {
+                    dst_store->ops->write_async(dst_store, refs.buf + i * MD5_DIGEST_LENGTH, MD5_DIGEST_LENGTH,
+                                                value, value_len);
+                    free(value);
+                }
+            }
+        }
+    }
+
+    dyn_buffer_destroy(&refs);
+}
+
+void store_delete_keys(store_t *store, const char *keys, size_t key_len, size_t key_count) {
+    store->ops->delete_keys(store, keys, key_len, key_count);
+}
+
+void store_copy(store_t *store, const char *destination) {
+    store->ops->copy(store, destination);
+}
+
+/**
+ * @return disk usage of the files of a store
+ */
+static size_t store_disk_usage(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    size_t size = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        char file_path[PATH_MAX];
+        snprintf(file_path, PATH_MAX, "%s/%s", path, de->d_name);
+
+        struct stat info;
+        if (stat(file_path, &info) == 0 && S_ISREG(info.st_mode)) {
+            // The LMDB data file is sparse
+            size += info.st_blocks * 512;
+        }
+    }
+    closedir(dir);
+
+    return size;
+}
+
+static void store_remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        char file_path[PATH_MAX];
+        snprintf(file_path, PATH_MAX, "%s/%s", path, de->d_name);
+        unlink(file_path);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+void store_compact(const char *path, size_t chunk_size, size_t *size_before, size_t *size_after) {
+    char tmp_path[PATH_MAX];
+    char old_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s.compact", path);
+    snprintf(old_path, PATH_MAX, "%s.old", path);
+
+    // Interrupted swap of a pack store
+    if (access(path, F_OK) != 0 && access(old_path, F_OK) == 0) {
+        rename(old_path, path);
+    }
+    store_remove_dir(tmp_path);
+    store_remove_dir(old_path);
+
+    *size_before = store_disk_usage(path);
+    *size_after = *size_before;
+
+    store_t *store = store_open(path, chunk_size, STORE_BACKEND_LMDB);
+
+    if (store->ops == &LmdbStoreOps) {
+#if (SIST_FAKE_STORE != 1)
+        mkdir(tmp_path, S_IWUSR | S_IRUSR | S_IXUSR);
+        int ret = mdb_env_copy2(store->env, tmp_path, MDB_CP_COMPACT);
+        store_destroy(store);
+
+        if (ret != 0) {
+            LOG_ERRORF("store.c", "Could not compact store %s: %s", path, mdb_strerror(ret))
+            store_remove_dir(tmp_path);
+            return;
+        }
+
+        // The lock file of the store is reused
+        char data_path[PATH_MAX];
+        char tmp_data_path[PATH_MAX];
+        snprintf(data_path, PATH_MAX, "%s/data.mdb", path);
+        snprintf(tmp_data_path, PATH_MAX, "%s/data.mdb", tmp_path);
+        if (rename(tmp_data_path, data_path) != 0) {
+            LOG_FATALF("store.c", "Could not rename %s: %s", tmp_data_path, strerror(errno))
+        }
+        store_remove_dir(tmp_path);
+#else
+        store_destroy(store);
+#endif
+    } else {
+        store->ops->copy(store, tmp_path);
+        store_destroy(store);
+
+        // A pack store has several files: swap the directories
+        if (rename(path, old_path) != 0 || rename(tmp_path, path) != 0) {
+            LOG_FATALF("store.c", "Could not replace %s with %s: %s", path, tmp_path, strerror(errno))
+        }
+        store_remove_dir(old_path);
+    }
+
+    *size_after = store_disk_usage(path);
+}
@@ -5,33 +5,207 @@
 #include <lmdb.h>
 
 #include <glib.h>
+#include <openssl/md5.h>
 
 #define STORE_SIZE_TN (1024 * 1024 * 5)
 #define STORE_SIZE_TAG (1024 * 1024)
 #define STORE_SIZE_META STORE_SIZE_TAG
 
+// Maximum growth of the map when it is full, it otherwise doubles
+#define STORE_GROWTH_CAP (1024L * 1024 * 1024)
+
+// Pending writes of store_write_async() are committed when they reach this size...
+#define STORE_BATCH_SIZE (1024 * 1024 * 8)
+// ...or after this delay
+#define STORE_BATCH_DELAY_MS 200
+// store_write_async() blocks when this many bytes are pending
+#define STORE_QUEUE_MAX_SIZE (STORE_BATCH_SIZE * 4)
+
+typedef struct store_write_op {
+    struct store_write_op *next;
+    size_t key_len;
+    size_t buf_len;
+    // key, followed by the value
+    char data[0];
+} store_write_op_t;
+
+#define STORE_BACKEND_LMDB "lmdb"
+#define STORE_BACKEND_PACK "pack"
+
+/*
+ * With deduplication, a value is stored once with the md5 of its content as
+ * key. The value of the original key is a reference: the magic followed by
+ * the content md5.
+ */
+#define STORE_REF_MAGIC "SIST2REF"
+#define STORE_REF_MAGIC_SIZE (sizeof(STORE_REF_MAGIC) - 1)
+#define STORE_REF_SIZE (STORE_REF_MAGIC_SIZE + MD5_DIGEST_LENGTH)
+
+struct store_t;
+struct dyn_buffer;
+
+/*
+ * Operations of a store backend, see the store_* functions below
+ */
+typedef struct store_ops {
+    const char *name;
+    void (*destroy)(struct store_t *store);
+    void (*write)(struct store_t *store, char *key, size_t key_len, char *buf, size_t buf_len);
+    void (*write_async)(struct store_t *store, char *key, size_t key_len, char *buf, size_t buf_len);
+    void (*flush)(struct store_t *store);
+    char *(*read)(struct store_t *store, char *key, size_t key_len, size_t *ret_vallen);
+    const char *(*read_begin)(struct store_t *store, const char *key, size_t key_len, size_t *ret_vallen);
+    void (*read_end)(struct store_t *store);
+    GHashTable *(*read_all)(struct store_t *store);
+    size_t (*count)(struct store_t *store);
+    // dst_store has the same backend. The content keys of the copied references are appended to refs
+    void (*copy_keys)(struct store_t *store, struct store_t *dst_store, const char *keys, size_t key_len,
+                      size_t key_count, struct dyn_buffer *refs);
+    void (*delete_keys)(struct store_t *store, const char *keys, size_t key_len, size_t key_count);
+    void (*copy)(struct store_t *store, const char *destination);
+    // Append the content md5 of all the references in the store to refs, pending writes included
+    void (*read_refs)(struct store_t *store, struct dyn_buffer *refs);
+} store_ops_t;
+
 typedef struct store_t {
     char path[PATH_MAX];
+    const store_ops_t *ops;
+    // State of the other backends
+    void *backend;
+
     char *tmp_path;
     MDB_dbi dbi;
     MDB_env *env;
     size_t size;
     size_t chunk_size;
+    size_t growth_cap;
     pthread_rwlock_t lock;
+    int resize_count;
+    double resize_time;
+
+    // Reusable read transaction of store_read_begin()
+    MDB_txn *read_txn;
+
+    // Group-commit writer thread, started by the first store_write_async()
+    pthread_t writer_thread;
+    int writer_started;
+    int writer_stop;
+    pthread_mutex_t queue_mu;
+    pthread_cond_t queue_cond;
+    pthread_cond_t queue_space_cond;
+    store_write_op_t *queue_head;
+    store_write_op_t *queue_tail;
+    size_t queue_size;
+    size_t write_count;
+    size_t batch_count;
+    struct timespec writer_start;
+
+    // Content md5 of the values written with deduplication, NULL if it is disabled
+    GHashTable *content_table;
+    pthread_mutex_t content_mu;
+    size_t dedup_count;
+    size_t dedup_size;
 } store_t;
 
+/**
+ * LMDB store
+ */
 store_t *store_create(const char *path, size_t chunk_size);
 
+/**
+ * Open the existing store at path with its backend, or create a store with
+ * the given backend (STORE_BACKEND_*).
+ */
+store_t *store_open(const char *path, size_t chunk_size, const char *backend);
+
 void store_destroy(store_t *store);
 
+/**
+ * Deduplicate the values written to the store with store_write() and
+ * store_write_async() from now on, see STORE_REF_MAGIC. References are
+ * resolved by store_read() and store_read_begin(). The values already
+ * referenced in the store are not written again.
+ */
+void store_enable_dedup(store_t *store);
+
+/**
+ * Delete the deduplicated values that are no longer referenced, after
+ * their references were deleted or replaced. Deduplication must be enabled.
+ *
+ * @return number of deleted values
+ */
+size_t store_delete_unreferenced(store_t *store);
+
+/**
+ * @return TRUE if the value is a reference to a deduplicated value
+ */
+int store_is_ref(const char *value, size_t value_len);
+
+/**
+ * Grow the map to at least size bytes, to avoid resizing it while writing
+ */
+void store_reserve(store_t *store, size_t size);
+
 void store_write(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len);
 
+/**
+ * Queue a write, the key and value are copied. The writes of all threads are
+ * committed in batches by a writer thread (see STORE_BATCH_SIZE), they are
+ * all committed when store_destroy() returns.
+ */
+void store_write_async(store_t *store, char *key, size_t key_len, char *buf, size_t buf_len);
+
 void store_flush(store_t *store);
 
 char *store_read(store_t *store, char *key, size_t key_len, size_t *ret_vallen);
 
+/**
+ * Zero-copy read: the returned value points into the map and is valid until
+ * store_read_end(). The read transaction is reused between calls, only one
+ * thread at a time may use it.
+ *
+ * @return NULL if the key is not in the store
+ */
+const char *store_read_begin(store_t *store, const char *key, size_t key_len, size_t *ret_vallen);
+
+void store_read_end(store_t *store);
+
+/**
+ * LMDB stores only. Same as store_read_begin() with a caller-owned read transaction (initially
+ * NULL). The value is valid until store_txn_reset(*txn), the transaction must
+ * be released with store_txn_close().
+ */
+const char *store_txn_read(store_t *store, MDB_txn **txn, const char *key, size_t key_len, size_t *ret_vallen);
+
+void store_txn_reset(MDB_txn *txn);
+
+void store_txn_close(MDB_txn *txn);
+
+size_t store_count(store_t *store);
+
 GHashTable *store_read_all(store_t *store);
 
+/**
+ * Copy the values of key_count keys (of key_len bytes each, sorted) from
+ * store to dst_store. Between LMDB stores, this uses one cursor and one
+ * write transaction. Missing keys are skipped. The deduplicated values of
+ * copied references are copied once.
+ */
+void store_copy_keys(store_t *store, store_t *dst_store, const char *keys, size_t key_len, size_t key_count);
+
+/**
+ * Delete key_count keys (of key_len bytes each) in one write transaction.
+ * Missing keys are skipped.
+ */
+void store_delete_keys(store_t *store, const char *keys, size_t key_len, size_t key_count);
+
 void store_copy(store_t *store, const char *destination);
 
+/**
+ * Rewrite the store at path without its free pages (LMDB) or its replaced and
+ * deleted values (pack). The store is written to <path>.compact, which then
+ * replaces it. The store must not be opened.
+ */
+void store_compact(const char *path, size_t chunk_size, size_t *size_before, size_t *size_after);
+
 #endif
@@ -16,6 +16,7 @@
 
 #include <signal.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
 #include "stats.h"
 
@@ -29,6 +30,7 @@ static const char *const usage[] = {
         "sist2 index [OPTION]... INDEX",
         "sist2 web [OPTION]... INDEX...",
         "sist2 exec-script [OPTION]... INDEX",
+        "sist2 compact INDEX",
         NULL,
 };
 
@@ -109,11 +111,12 @@ void init_dir(const char *dirpath) {
 
     time(&ScanCtx.index.desc.timestamp);
     strcpy(ScanCtx.index.desc.version, Version);
-    strcpy(ScanCtx.index.desc.type, INDEX_TYPE_NDJSON);
 
-    unsigned char index_md5[MD5_DIGEST_LENGTH];
-    MD5((unsigned char *) &ScanCtx.index.desc.timestamp, sizeof(ScanCtx.index.desc.timestamp), index_md5);
-    buf2hex(index_md5, MD5_DIGEST_LENGTH, ScanCtx.index.desc.id);
+    if (!ScanCtx.in_place) {
+        unsigned char index_md5[MD5_DIGEST_LENGTH];
+        MD5((unsigned char *) &ScanCtx.index.desc.timestamp, sizeof(ScanCtx.index.desc.timestamp), index_md5);
+        buf2hex(index_md5, MD5_DIGEST_LENGTH, ScanCtx.index.desc.id);
+    }
 
     write_index_descriptor(path, &ScanCtx.index.desc);
 }
@@ -123,7 +126,15 @@ void scan_print_header() {
 }
 
 void _store(char *key, size_t key_len, char *buf, size_t buf_len) {
-    store_write(ScanCtx.index.store, key, key_len, buf, buf_len);
+    store_write_async(ScanCtx.index.store, key, key_len, buf, buf_len);
+}
+
+int _mem_reserve(size_t size) {
+    return mem_budget_reserve(&ScanCtx.mem_budget, size, FALSE);
+}
+
+void _mem_release(size_t size) {
+    mem_budget_release(&ScanCtx.mem_budget, size);
 }
 
 void _log(const char *filepath, int level, char *str) {
@@ -170,9 +181,9 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.dbg_current_files = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, NULL);
     pthread_mutex_init(&ScanCtx.dbg_current_files_mu, NULL);
     pthread_mutex_init(&ScanCtx.dbg_file_counts_mu, NULL);
-    pthread_mutex_init(&ScanCtx.copy_table_mu, NULL);
 
     ScanCtx.calculate_checksums = args->calculate_checksums;
+    mem_budget_init(&ScanCtx.mem_budget, (size_t) args->max_memory * 1024 * 1024);
 
     // Archive
     ScanCtx.arc_ctx.mode = args->archive_mode;
@@ -191,6 +202,7 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.comic_ctx.store = _store;
     ScanCtx.comic_ctx.tn_size = args->size;
     ScanCtx.comic_ctx.tn_qscale = args->quality;
+    ScanCtx.comic_ctx.tn_tiers = args->thumbnail_tiers;
     ScanCtx.comic_ctx.cbr_mime = mime_get_mime_by_string(ScanCtx.mime_table, "application/x-cbr");
     ScanCtx.comic_ctx.cbz_mime = mime_get_mime_by_string(ScanCtx.mime_table, "application/x-cbz");
 
@@ -205,6 +217,7 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.ebook_ctx.store = _store;
     ScanCtx.ebook_ctx.fast_epub_parse = args->fast_epub;
     ScanCtx.ebook_ctx.tn_qscale = args->quality;
+    ScanCtx.ebook_ctx.tn_tiers = args->thumbnail_tiers;
 
     // Font
     ScanCtx.font_ctx.enable_tn = args->size > 0;
@@ -215,11 +228,20 @@ void initialize_scan_context(scan_args_t *args) {
     // Media
     ScanCtx.media_ctx.tn_qscale = args->quality;
     ScanCtx.media_ctx.tn_size = args->size;
+    ScanCtx.media_ctx.tn_tiers = args->thumbnail_tiers;
     ScanCtx.media_ctx.log = _log;
     ScanCtx.media_ctx.logf = _logf;
     ScanCtx.media_ctx.store = _store;
     ScanCtx.media_ctx.max_media_buffer = (long) args->max_memory_buffer * 1024 * 1024;
+    ScanCtx.media_ctx.max_media_spill = (long) args->max_spill_size * 1024 * 1024;
+    ScanCtx.media_ctx.spill_dir = args->spill_dir;
     ScanCtx.media_ctx.read_subtitles = args->read_subtitles;
+    ScanCtx.media_ctx.fast_video_tn = args->fast_video_thumbnails;
+    ScanCtx.media_ctx.probe_size = (long) args->probe_size * 1024;
+    ScanCtx.media_ctx.analyze_duration = (long) args->analyze_duration * 1000;
+    ScanCtx.media_ctx.fast_probe = args->fast_probe;
+    ScanCtx.media_ctx.mem_reserve = _mem_reserve;
+    ScanCtx.media_ctx.mem_release = _mem_release;
 
     if (args->ocr_images) {
         ScanCtx.media_ctx.tesseract_lang = args->tesseract_lang;
@@ -259,11 +281,21 @@ void initialize_scan_context(scan_args_t *args) {
     strncpy(ScanCtx.index.desc.root, args->path, sizeof(ScanCtx.index.desc.root));
     strncpy(ScanCtx.index.desc.rewrite_url, args->rewrite_url, sizeof(ScanCtx.index.desc.rewrite_url));
     ScanCtx.index.desc.root_len = (short) strlen(ScanCtx.index.desc.root);
+    ScanCtx.index.desc.compression_level = args->compression_level;
+    ScanCtx.index.desc.compression_workers = args->compression_threads;
+    ScanCtx.index.desc.compression_ldm = args->long_distance_matching;
+    ScanCtx.compression_dict_samples = args->compression_dict_samples;
+    ScanCtx.index.desc.compression_frame_size = (long) args->compression_frame_size * 1024;
+    strncpy(ScanCtx.index.desc.type, args->index_type, sizeof(ScanCtx.index.desc.type));
+    ScanCtx.index.desc.thumbnail_size = args->size;
+    ScanCtx.index.desc.thumbnail_tiers = args->thumbnail_tiers;
     ScanCtx.fast = args->fast;
+    ScanCtx.in_place = args->in_place;
 
     // Raw
     ScanCtx.raw_ctx.tn_qscale = args->quality;
     ScanCtx.raw_ctx.tn_size = args->size;
+    ScanCtx.raw_ctx.tn_tiers = args->thumbnail_tiers;
     ScanCtx.raw_ctx.log = _log;
     ScanCtx.raw_ctx.logf = _logf;
     ScanCtx.raw_ctx.store = _store;
@@ -283,10 +315,33 @@ void initialize_scan_context(scan_args_t *args) {
 }
 
 
-void load_incremental_index(const scan_args_t *args) {
-    ScanCtx.original_table = incremental_get_table();
-    ScanCtx.copy_table = incremental_get_table();
+void set_thumbnail_tiers(const thumbnail_tiers_t *tiers) {
+    ScanCtx.index.desc.thumbnail_tiers = *tiers;
+    ScanCtx.comic_ctx.tn_tiers = *tiers;
+    ScanCtx.ebook_ctx.tn_tiers = *tiers;
+    ScanCtx.media_ctx.tn_tiers = *tiers;
+    ScanCtx.raw_ctx.tn_tiers = *tiers;
+}
+
+int thumbnail_tiers_equal(const thumbnail_tiers_t *a, const thumbnail_tiers_t *b) {
+    if (a->count != b->count) {
+        return FALSE;
+    }
+    for (int i = 0; i < a->count; i++) {
+        int found = FALSE;
+        for (int j = 0; j < b->count; j++) {
+            if (a->sizes[i] == b->sizes[j]) {
+                found = TRUE;
+            }
+        }
+        if (!found) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
 
+void load_incremental_index(const scan_args_t *args) {
     DIR *dir = opendir(args->incremental);
     if (dir == NULL) {
         LOG_FATALF("main.c", "Could not open original index for incremental scan: %s", strerror(errno))
@@ -300,17 +355,174 @@ void load_incremental_index(const scan_args_t *args) {
         LOG_FATALF("main.c", "Version mismatch! Index is %s but executable is %s", original_desc.version, Version)
     }
 
+    // Documents are copied as-is from the original index
+    if (strcmp(original_desc.type, ScanCtx.index.desc.type) != 0) {
+        LOG_FATALF("main.c", "Index type mismatch! Index is %s but --index-type is %s",
+                   original_desc.type, ScanCtx.index.desc.type)
+    }
+
+    // The thumbnails of the documents that are kept are at the tiers of the original index
+    ScanCtx.original_tiers = original_desc.thumbnail_tiers;
+    if (args->size > 0) {
+        if (args->thumbnail_tiers_str == NULL) {
+            set_thumbnail_tiers(&original_desc.thumbnail_tiers);
+        } else if (!thumbnail_tiers_equal(&original_desc.thumbnail_tiers, &ScanCtx.index.desc.thumbnail_tiers)) {
+            LOG_FATALF("main.c", "Thumbnail tiers mismatch! Index has %d tiers, --thumbnail-tiers must be omitted "
+                                 "or list the same sizes as the original index (%s)",
+                       original_desc.thumbnail_tiers.count, args->thumbnail_tiers_str)
+        }
+    }
+
+    manifest_t *manifest = manifest_open(args->incremental);
+    if (manifest != NULL) {
+        closedir(dir);
+
+        ScanCtx.original_table = inc_table_create(manifest->count);
+        for (size_t i = 0; i < manifest->count; i++) {
+            uint32_t flags = le32toh(manifest->entries[i].flags);
+            inc_table_put(ScanCtx.original_table, manifest->entries[i].path_md5,
+                          (int) le32toh(manifest->entries[i].mtime),
+                          (flags & MANIFEST_FLAG_PARENT ? INC_TABLE_FLAG_PARENT : 0) |
+                          (flags & MANIFEST_FLAG_DEFERRED ? INC_TABLE_FLAG_DEFERRED : 0));
+        }
+        manifest_close(manifest);
+
+        LOG_INFOF("main.c", "Loaded %zu items from the manifest of the original index.", ScanCtx.original_table->count)
+        return;
+    }
+    LOG_INFO("main.c", "Original index has no manifest, reading mtimes from the index files.")
+
+    ScanCtx.original_table = inc_table_create(0);
+
     struct dirent *de;
     while ((de = readdir(dir)) != NULL) {
         if (strncmp(de->d_name, "_index", sizeof("_index") - 1) == 0) {
             char file_path[PATH_MAX];
             snprintf(file_path, PATH_MAX, "%s%s", args->incremental, de->d_name);
-            incremental_read(ScanCtx.original_table, file_path, &original_desc);
+            incremental_read(ScanCtx.original_table, file_path, &original_desc, args->threads);
         }
     }
     closedir(dir);
 
-    LOG_INFOF("main.c", "Loaded %d items in to mtime table.", g_hash_table_size(ScanCtx.original_table))
+    LOG_INFOF("main.c", "Loaded %zu items in to mtime table.", ScanCtx.original_table->count)
+}
+
+/**
+ * The documents of an in-place scan are written to a new delta index file
+ * of the output index, with the same id and compression dictionary.
+ */
+void prepare_in_place_scan() {
+    char descriptor_path[PATH_MAX];
+    snprintf(descriptor_path, PATH_MAX, "%sdescriptor.json", ScanCtx.index.path);
+    index_descriptor_t original_desc = read_index_descriptor(descriptor_path);
+
+    strcpy(ScanCtx.index.desc.id, original_desc.id);
+    strcpy(ScanCtx.index.desc.compression_dict, original_desc.compression_dict);
+    ScanCtx.compression_dict_samples = 0;
+    writer_load_index_dict(ScanCtx.index.path, &original_desc);
+
+    ScanCtx.generation = index_next_generation(ScanCtx.index.path);
+    LOG_INFOF("main.c", "In-place scan, writing delta index generation %d", ScanCtx.generation)
+}
+
+/**
+ * Record the documents of the original index that were deleted. In-place
+ * scans also tombstone the documents that were rewritten or deleted, delete
+ * the thumbnails that are no longer referenced and add the documents that
+ * were kept to the new manifest.
+ */
+void finalize_incremental_scan() {
+    inc_table_t *table = ScanCtx.original_table;
+
+    // The new manifest is still a temporary file
+    manifest_t *manifest = ScanCtx.in_place ? manifest_open(ScanCtx.index.path) : NULL;
+
+    dyn_buffer_t tombstones = dyn_buffer_create();
+    dyn_buffer_t deleted = dyn_buffer_create();
+    size_t rewritten_count = 0;
+    size_t unchanged_count = 0;
+    size_t deleted_count = 0;
+
+    for (size_t i = 0; i <= table->mask; i++) {
+        const inc_table_entry_t *entry = &table->entries[i];
+        if (md5_digest_is_null(entry->path_md5)) {
+            continue;
+        }
+
+        if (entry->flags & INC_TABLE_FLAG_REWRITTEN) {
+            dyn_buffer_write(&tombstones, entry->path_md5, MD5_DIGEST_LENGTH);
+            rewritten_count += 1;
+        } else if (entry->flags & (INC_TABLE_FLAG_COPY | INC_TABLE_FLAG_PARENT)) {
+            unchanged_count += 1;
+            if (ScanCtx.in_place) {
+                const manifest_entry_t *original = manifest == NULL ? NULL : manifest_get(manifest, entry->path_md5);
+                manifest_add(entry->path_md5, entry->mtime, original == NULL ? 0 : le64toh(original->size),
+                             (entry->flags & INC_TABLE_FLAG_PARENT ? MANIFEST_FLAG_PARENT : 0) |
+                             (entry->flags & INC_TABLE_FLAG_DEFERRED ? MANIFEST_FLAG_DEFERRED : 0));
+            }
+        } else {
+            changes_add(entry->path_md5, CHANGE_DELETED);
+            dyn_buffer_write(&tombstones, entry->path_md5, MD5_DIGEST_LENGTH);
+            dyn_buffer_write(&deleted, entry->path_md5, MD5_DIGEST_LENGTH);
+            deleted_count += 1;
+        }
+    }
+
+    if (manifest != NULL) {
+        manifest_close(manifest);
+    }
+
+    changes_write(ScanCtx.index.path, ScanCtx.generation, unchanged_count);
+
+    if (ScanCtx.in_place) {
+        write_index_tombstones(ScanCtx.index.path, ScanCtx.generation, tombstones.buf,
+                               tombstones.cur / MD5_DIGEST_LENGTH);
+        if (deleted_count > 0) {
+            // Thumbnail tiers of the deleted documents
+            for (size_t i = 0; i < deleted_count; i++) {
+                unsigned char path_md5[MD5_DIGEST_LENGTH];
+                memcpy(path_md5, deleted.buf + i * MD5_DIGEST_LENGTH, MD5_DIGEST_LENGTH);
+                write_thumbnail_tier_keys(&deleted, path_md5);
+            }
+            store_delete_keys(ScanCtx.index.store, deleted.buf, MD5_DIGEST_LENGTH,
+                              deleted.cur / MD5_DIGEST_LENGTH);
+        }
+
+        size_t unreferenced_count = 0;
+        if (deleted_count > 0 || rewritten_count > 0) {
+            // Thumbnails of the deleted and rewritten documents that are not shared with other documents
+            unreferenced_count = store_delete_unreferenced(ScanCtx.index.store);
+        }
+
+        LOG_INFOF("main.c", "In-place scan: %zu documents rewritten, %zu documents deleted, "
+                            "%zu unreferenced thumbnails deleted",
+                  rewritten_count, deleted_count, unreferenced_count)
+    }
+
+    dyn_buffer_destroy(&tombstones);
+    dyn_buffer_destroy(&deleted);
+}
+
+/**
+ * Compact the thumbnail, tag and metadata stores of an index
+ */
+void compact_stores(const char *index_path) {
+    const char *names[] = {"thumbs", "tags", "meta"};
+    const size_t chunk_sizes[] = {STORE_SIZE_TN, STORE_SIZE_TAG, STORE_SIZE_META};
+
+    for (int i = 0; i < 3; i++) {
+        char store_path[PATH_MAX];
+        snprintf(store_path, PATH_MAX, "%s%s", index_path, names[i]);
+        if (access(store_path, F_OK) != 0) {
+            continue;
+        }
+
+        size_t size_before;
+        size_t size_after;
+        store_compact(store_path, chunk_sizes[i], &size_before, &size_after);
+        LOG_INFOF("main.c", "Compacted %s store: %.2fMB -> %.2fMB", names[i],
+                  (double) size_before / (1024 * 1024), (double) size_after / (1024 * 1024))
+    }
 }
 
 void sist2_scan(scan_args_t *args) {
@@ -320,11 +532,17 @@ void sist2_scan(scan_args_t *args) {
 
     initialize_scan_context(args);
 
+    if (ScanCtx.in_place) {
+        prepare_in_place_scan();
+    }
+
     init_dir(ScanCtx.index.path);
 
     char store_path[PATH_MAX];
     snprintf(store_path, PATH_MAX, "%sthumbs", ScanCtx.index.path);
-    ScanCtx.index.store = store_create(store_path, STORE_SIZE_TN);
+    ScanCtx.index.store = store_open(store_path, STORE_SIZE_TN, args->thumbnail_store);
+    ScanCtx.index.store->growth_cap = (size_t) args->store_growth_cap * 1024 * 1024;
+    store_enable_dedup(ScanCtx.index.store);
 
     snprintf(store_path, PATH_MAX, "%smeta", ScanCtx.index.path);
     ScanCtx.index.meta_store = store_create(store_path, STORE_SIZE_META);
@@ -335,6 +553,15 @@ void sist2_scan(scan_args_t *args) {
         load_incremental_index(args);
     }
 
+    if (args->incremental != NULL && !args->in_place) {
+        // The new thumbnail store will be about as large as the original one
+        snprintf(store_path, PATH_MAX, "%sthumbs/data.mdb", args->incremental);
+        struct stat info;
+        if (stat(store_path, &info) == 0) {
+            store_reserve(ScanCtx.index.store, info.st_size + info.st_size / 8);
+        }
+    }
+
     ScanCtx.pool = tpool_create(args->threads, thread_cleanup, TRUE, TRUE);
     tpool_start(ScanCtx.pool);
 
@@ -365,11 +592,29 @@ void sist2_scan(scan_args_t *args) {
     LOG_DEBUGF("main.c", "Excluded files: %d", ScanCtx.dbg_excluded_files_count)
     LOG_DEBUGF("main.c", "Failed files: %d", ScanCtx.dbg_failed_files_count)
 
-    if (args->incremental != NULL) {
+    media_log_stats(&ScanCtx.media_ctx);
+
+    if (ScanCtx.mem_budget.max > 0) {
+        LOG_INFOF("main.c", "Memory budget: %.2fMB peak reservations, %lu files waited, "
+                            "%lu files deferred (metadata only)",
+                  (double) ScanCtx.mem_budget.peak / (1024 * 1024), ScanCtx.mem_budget.wait_count,
+                  ScanCtx.mem_budget.defer_count)
+    }
+
+    if (ScanCtx.original_table != NULL) {
+        finalize_incremental_scan();
+    }
+
+    if (args->incremental != NULL && !ScanCtx.in_place) {
         char dst_path[PATH_MAX];
         snprintf(store_path, PATH_MAX, "%sthumbs", args->incremental);
-        snprintf(dst_path, PATH_MAX, "%s_index_original.ndjson.zst", ScanCtx.index.path);
-        store_t *source = store_create(store_path, STORE_SIZE_TN);
+        snprintf(dst_path, PATH_MAX, "%s_index_original.%s.zst", ScanCtx.index.path,
+                 ScanCtx.index.desc.type);
+        store_t *source = store_open(store_path, STORE_SIZE_TN, STORE_BACKEND_LMDB);
+
+        char descriptor_path[PATH_MAX];
+        snprintf(descriptor_path, PATH_MAX, "%sdescriptor.json", args->incremental);
+        index_descriptor_t original_desc = read_index_descriptor(descriptor_path);
 
         DIR *dir = opendir(args->incremental);
         if (dir == NULL) {
@@ -381,7 +626,8 @@ void sist2_scan(scan_args_t *args) {
             if (strncmp(de->d_name, "_index_", sizeof("_index_") - 1) == 0) {
                 char file_path[PATH_MAX];
                 snprintf(file_path, PATH_MAX, "%s%s", args->incremental, de->d_name);
-                incremental_copy(source, ScanCtx.index.store, file_path, dst_path, ScanCtx.copy_table);
+                incremental_copy(source, ScanCtx.index.store, file_path, dst_path, ScanCtx.original_table,
+                                 &original_desc);
             }
         }
         closedir(dir);
@@ -395,10 +641,39 @@ void sist2_scan(scan_args_t *args) {
         store_destroy(source_tags);
     }
 
+    manifest_write(ScanCtx.index.path);
+    if (ScanCtx.original_table != NULL) {
+        inc_table_destroy(ScanCtx.original_table);
+    }
+
+    // Record the effective writer parameters
+    char descriptor_path[PATH_MAX];
+    snprintf(descriptor_path, PATH_MAX, "%sdescriptor.json", ScanCtx.index.path);
+    write_index_descriptor(descriptor_path, &ScanCtx.index.desc);
+
     generate_stats(&ScanCtx.index, args->treemap_threshold, ScanCtx.index.path);
 
+    LOG_INFOF("main.c", "Thumbnail deduplication: %zu duplicate thumbnails, %.2fMB saved",
+              ScanCtx.index.store->dedup_count, (double) ScanCtx.index.store->dedup_size / (1024 * 1024))
+
     store_destroy(ScanCtx.index.store);
     store_destroy(ScanCtx.index.meta_store);
+
+    if (args->compact_stores) {
+        compact_stores(ScanCtx.index.path);
+    }
+}
+
+static inc_table_t *DeltaChanges;
+static index_func DeltaIndexFunc;
+
+void delta_index_func(cJSON *document, const char index_id_str[MD5_STR_LENGTH]) {
+    unsigned char path_md5[MD5_DIGEST_LENGTH];
+    hex2buf(index_id_str, MD5_STR_LENGTH - 1, path_md5);
+
+    if (inc_table_get(DeltaChanges, path_md5) != 0) {
+        DeltaIndexFunc(document, index_id_str);
+    }
 }
 
 void sist2_index(index_args_t *args) {
@@ -429,12 +704,17 @@ void sist2_index(index_args_t *args) {
 
     char path_tmp[PATH_MAX];
     snprintf(path_tmp, sizeof(path_tmp), "%s/tags", args->index_path);
-    IndexCtx.tag_store = store_create(path_tmp, STORE_SIZE_TAG);
-    IndexCtx.tags = store_read_all(IndexCtx.tag_store);
+    store_t *tag_store = store_create(path_tmp, STORE_SIZE_TAG);
 
     snprintf(path_tmp, sizeof(path_tmp), "%s/meta", args->index_path);
-    IndexCtx.meta_store = store_create(path_tmp, STORE_SIZE_META);
-    IndexCtx.meta = store_read_all(IndexCtx.meta_store);
+    store_t *meta_store = store_create(path_tmp, STORE_SIZE_META);
+
+    // Tags and meta are looked up for each document, skip the empty stores
+    size_t tag_count = store_count(tag_store);
+    size_t meta_count = store_count(meta_store);
+    IndexCtx.tag_store = tag_count > 0 ? tag_store : NULL;
+    IndexCtx.meta_store = meta_count > 0 ? meta_store : NULL;
+    LOG_DEBUGF("main.c", "%zu tags, %zu sidecar meta entries", tag_count, meta_count)
 
     index_func f;
     if (args->print) {
@@ -450,32 +730,85 @@ void sist2_index(index_args_t *args) {
         cleanup = elastic_cleanup;
     }
 
+    changes_t *changes = NULL;
+    if (args->delta) {
+        snprintf(path_tmp, sizeof(path_tmp), "%s/", args->index_path);
+        changes = changes_read(path_tmp);
+        if (changes == NULL) {
+            LOG_FATALF("main.c", "Index %s has no changes file, --delta requires an incremental scan",
+                       args->index_path)
+        }
+
+        // The status is stored in place of the mtime
+        DeltaChanges = inc_table_create(changes->count);
+        for (size_t i = 0; i < changes->count; i++) {
+            if (changes->entries[i].status != CHANGE_DELETED) {
+                inc_table_put(DeltaChanges, changes->entries[i].path_md5, (int) changes->entries[i].status, 0);
+            }
+        }
+        DeltaIndexFunc = f;
+        f = delta_index_func;
+
+        LOG_INFOF("main.c", "Delta: %lu new, %lu modified, %lu deleted documents (%lu unchanged)",
+                  changes->header.new_count, changes->header.modified_count, changes->header.deleted_count,
+                  changes->header.unchanged_count)
+    }
+
     IndexCtx.pool = tpool_create(args->threads, cleanup, FALSE, args->print == 0);
     tpool_start(IndexCtx.pool);
 
     struct dirent *de;
     while ((de = readdir(dir)) != NULL) {
         if (strncmp(de->d_name, "_index_", sizeof("_index_") - 1) == 0) {
+            // The new and modified documents are in the index files written by the scan
+            if (changes != NULL && (strncmp(de->d_name, "_index_original", sizeof("_index_original") - 1) == 0 ||
+                                    index_file_generation(de->d_name) != changes->header.generation)) {
+                continue;
+            }
+
             char file_path[PATH_MAX];
             snprintf(file_path, PATH_MAX, "%s/%s", args->index_path, de->d_name);
-            read_index(file_path, desc.id, desc.type, f);
+            // Printed documents keep the order of the index file
+            read_index_parallel(file_path, &desc, f, args->print ? 1 : args->threads);
             LOG_DEBUGF("main.c", "Read index file %s (%s)", file_path, desc.type)
         }
     }
     closedir(dir);
 
+    if (changes != NULL) {
+        for (size_t i = 0; i < changes->count; i++) {
+            if (changes->entries[i].status == CHANGE_DELETED) {
+                char path_md5_str[MD5_STR_LENGTH];
+                buf2hex(changes->entries[i].path_md5, MD5_DIGEST_LENGTH, path_md5_str);
+                if (args->print) {
+                    print_delete_json(path_md5_str);
+                } else {
+                    delete_json(path_md5_str);
+                }
+            }
+        }
+        changes_destroy(changes);
+    }
+
     tpool_wait(IndexCtx.pool);
 
     tpool_destroy(IndexCtx.pool);
 
+    if (DeltaChanges != NULL) {
+        inc_table_destroy(DeltaChanges);
+    }
+
     if (!args->print) {
         finish_indexer(args->script, args->async_script, desc.id);
     }
 
-    store_destroy(IndexCtx.tag_store);
-    store_destroy(IndexCtx.meta_store);
-    g_hash_table_remove_all(IndexCtx.tags);
-    g_hash_table_destroy(IndexCtx.tags);
+    read_index_thread_cleanup();
+    store_destroy(tag_store);
+    store_destroy(meta_store);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    LOG_INFOF("main.c", "Peak memory usage: %ldMB", usage.ru_maxrss / 1024)
 }
 
 void sist2_exec_script(exec_args_t *args) {
@@ -516,7 +849,7 @@ void sist2_web(web_args_t *args) {
         char path_tmp[PATH_MAX];
 
         snprintf(path_tmp, PATH_MAX, "%sthumbs", abs_path);
-        WebCtx.indices[i].store = store_create(path_tmp, STORE_SIZE_TN);
+        WebCtx.indices[i].store = store_open(path_tmp, STORE_SIZE_TN, STORE_BACKEND_LMDB);
 
         snprintf(path_tmp, PATH_MAX, "%stags", abs_path);
         mkdir(path_tmp, S_IWUSR | S_IRUSR | S_IXUSR);
@@ -544,6 +877,7 @@ int main(int argc, const char *argv[]) {
     index_args_t *index_args = index_args_create();
     web_args_t *web_args = web_args_create();
     exec_args_t *exec_args = exec_args_create();
+    compact_args_t *compact_args = compact_args_create();
 
     int arg_version = 0;
 
@@ -566,10 +900,15 @@ int main(int argc, const char *argv[]) {
                       "Thumbnail quality, on a scale of 1.0 to 31.0, 1.0 being the best. DEFAULT=3"),
             OPT_INTEGER(0, "size", &scan_args->size,
                         "Thumbnail size, in pixels. Use negative value to disable. DEFAULT=500"),
+            OPT_STRING(0, "thumbnail-tiers", &scan_args->thumbnail_tiers_str,
+                       "Comma-separated list of additional thumbnail sizes, in pixels (e.g. 128,1024)."),
             OPT_INTEGER(0, "content-size", &scan_args->content_size,
                         "Number of bytes to be extracted from text documents. Use negative value to disable. DEFAULT=32768"),
             OPT_STRING(0, "incremental", &scan_args->incremental,
                        "Reuse an existing index and only scan modified files."),
+            OPT_BOOLEAN(0, "in-place", &scan_args->in_place,
+                        "Incremental scan of the index in the output directory, only the modified files are "
+                        "written to a new delta index file."),
             OPT_STRING('o', "output", &scan_args->output, "Output directory. DEFAULT=index.sist2/"),
             OPT_STRING(0, "rewrite-url", &scan_args->rewrite_url, "Serve files from this url instead of from disk."),
             OPT_STRING(0, "name", &scan_args->name, "Index display name. DEFAULT: (name of the directory)"),
@@ -591,15 +930,56 @@ int main(int argc, const char *argv[]) {
             OPT_STRING(0, "treemap-threshold", &scan_args->treemap_threshold_str, "Relative size threshold for treemap "
                                                                                   "(see USAGE.md). DEFAULT: 0.0005"),
             OPT_INTEGER(0, "mem-buffer", &scan_args->max_memory_buffer,
-                        "Maximum memory buffer size per thread in MB for files inside archives "
-                        "(see USAGE.md). DEFAULT: 2000"),
+                        "Maximum memory buffer size in MB for media files inside archives, shared "
+                        "by all threads (see USAGE.md). DEFAULT: 2000"),
+            OPT_INTEGER(0, "max-spill-size", &scan_args->max_spill_size,
+                        "Maximum size in MB of media files inside archives copied to a temporary file "
+                        "(see USAGE.md). DEFAULT: 8000"),
+            OPT_STRING(0, "spill-dir", &scan_args->spill_dir,
+                       "Directory of the temporary files of --max-spill-size, should not be a tmpfs "
+                       "(see USAGE.md). DEFAULT: output directory"),
+            OPT_INTEGER(0, "max-memory", &scan_args->max_memory,
+                        "Memory budget in MB for parsing files, shared by all threads (see USAGE.md). "
+                        "DEFAULT: 0 (unlimited)"),
             OPT_BOOLEAN(0, "read-subtitles", &scan_args->read_subtitles, "Read subtitles from media files."),
+            OPT_BOOLEAN(0, "fast-video-thumbnails", &scan_args->fast_video_thumbnails,
+                        "Only decode the nearest keyframe when generating video thumbnails."),
+            OPT_INTEGER(0, "probe-size", &scan_args->probe_size,
+                        "Maximum number of KB read to detect the streams of media files. DEFAULT: FFmpeg default"),
+            OPT_INTEGER(0, "analyze-duration", &scan_args->analyze_duration,
+                        "Maximum duration in ms of media analyzed to detect streams. DEFAULT: FFmpeg default"),
+            OPT_BOOLEAN(0, "fast-probe", &scan_args->fast_probe,
+                        "Skip stream detection when the media file header has the duration and codec parameters."),
             OPT_BOOLEAN(0, "fast-epub", &scan_args->fast_epub,
                         "Faster but less accurate EPUB parsing (no thumbnails, metadata)"),
             OPT_BOOLEAN(0, "checksums", &scan_args->calculate_checksums, "Calculate file checksums when scanning."),
             OPT_STRING(0, "list-file", &scan_args->list_path, "Specify a list of newline-delimited paths to be scanned"
                                                               " instead of normal directory traversal. Use '-' to read"
                                                               " from stdin."),
+            OPT_INTEGER(0, "compression-level", &scan_args->compression_level,
+                        "Zstd compression level of the index files (1-22). DEFAULT=10"),
+            OPT_INTEGER(0, "compression-threads", &scan_args->compression_threads,
+                        "Number of zstd worker threads used to compress the index files. "
+                        "Use 0 to compress in the writer thread. DEFAULT=0"),
+            OPT_BOOLEAN(0, "long-distance-matching", &scan_args->long_distance_matching,
+                        "Enable zstd long distance matching for the index files."),
+            OPT_BOOLEAN(0, "fast-output", &scan_args->fast_output,
+                        "Favor index compression speed over size, for scans that are indexed right away. "
+                        "Same as --compression-level=1 --compression-threads=<threads>"),
+            OPT_INTEGER(0, "compression-dict-samples", &scan_args->compression_dict_samples,
+                        "Train a zstd dictionary on the first N documents and compress the index files with it. "
+                        "Use 0 to disable. DEFAULT=0"),
+            OPT_INTEGER(0, "compression-frame-size", &scan_args->compression_frame_size,
+                        "Uncompressed size in kB of the independent zstd frames of the index files. "
+                        "DEFAULT=4096 (128 with --compression-dict-samples)"),
+            OPT_STRING(0, "index-type", &scan_args->index_type,
+                       "Format of the index files (ndjson|binary). DEFAULT=ndjson"),
+            OPT_INTEGER(0, "store-growth-cap", &scan_args->store_growth_cap,
+                        "Maximum size in MB by which the thumbnail store grows at once. DEFAULT=1024"),
+            OPT_STRING(0, "thumbnail-store", &scan_args->thumbnail_store,
+                       "Backend of the thumbnail store (lmdb|pack). DEFAULT=lmdb"),
+            OPT_BOOLEAN(0, "compact-stores", &scan_args->compact_stores,
+                        "Compact the thumbnail, tag and metadata stores at the end of the scan."),
 
             OPT_GROUP("Index options"),
             OPT_INTEGER('t', "threads", &common_threads, "Number of threads. DEFAULT=1"),
@@ -613,6 +993,8 @@ int main(int argc, const char *argv[]) {
             OPT_INTEGER(0, "batch-size", &index_args->batch_size, "Index batch size. DEFAULT: 100"),
             OPT_BOOLEAN('f', "force-reset", &index_args->force_reset, "Reset Elasticsearch mappings and settings. "
                                                                       "(You must use this option the first time you use the index command)"),
+            OPT_BOOLEAN(0, "delta", &index_args->delta, "Only send the documents that were added, modified or "
+                                                        "deleted by the last incremental scan."),
 
             OPT_GROUP("Web options"),
             OPT_STRING(0, "es-url", &common_es_url, "Elasticsearch url. DEFAULT=http://localhost:9200"),
@@ -697,6 +1079,15 @@ int main(int argc, const char *argv[]) {
         }
         sist2_exec_script(exec_args);
 
+    } else if (strcmp(argv[0], "compact") == 0) {
+
+        int err = compact_args_validate(compact_args, argc, argv);
+        if (err != 0) {
+            goto end;
+        }
+        index_compact_deltas(compact_args->index_path);
+        compact_stores(compact_args->index_path);
+
     } else {
         fprintf(stderr, "Invalid command: '%s'\n", argv[0]);
         argparse_usage(&argparse);
@@ -709,6 +1100,7 @@ int main(int argc, const char *argv[]) {
     index_args_destroy(index_args);
     web_args_destroy(web_args);
     exec_args_destroy(exec_args);
+    compact_args_destroy(compact_args);
 
     return 0;
 }
@@ -0,0 +1,50 @@
+#include "mem_budget.h"
+
+#include "src/sist.h"
+
+void mem_budget_init(mem_budget_t *budget, size_t max) {
+    budget->max = max;
+    budget->used = 0;
+    budget->peak = 0;
+    budget->wait_count = 0;
+    budget->defer_count = 0;
+
+    pthread_mutex_init(&budget->mu, NULL);
+    pthread_cond_init(&budget->released_cond, NULL);
+}
+
+int mem_budget_reserve(mem_budget_t *budget, size_t size, int wait) {
+    pthread_mutex_lock(&budget->mu);
+
+    if (budget->max != 0 && budget->used + size > budget->max) {
+        if (!wait) {
+            pthread_mutex_unlock(&budget->mu);
+            return FALSE;
+        }
+        if (size > budget->max) {
+            budget->defer_count += 1;
+            pthread_mutex_unlock(&budget->mu);
+            return FALSE;
+        }
+
+        budget->wait_count += 1;
+        while (budget->used + size > budget->max) {
+            pthread_cond_wait(&budget->released_cond, &budget->mu);
+        }
+    }
+
+    budget->used += size;
+    if (budget->used > budget->peak) {
+        budget->peak = budget->used;
+    }
+
+    pthread_mutex_unlock(&budget->mu);
+    return TRUE;
+}
+
+void mem_budget_release(mem_budget_t *budget, size_t size) {
+    pthread_mutex_lock(&budget->mu);
+    budget->used -= size;
+    pthread_cond_broadcast(&budget->released_cond);
+    pthread_mutex_unlock(&budget->mu);
+}
@@ -0,0 +1,39 @@
+#ifndef SIST2_MEM_BUDGET_H
+#define SIST2_MEM_BUDGET_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Process-wide memory budget shared by the parse threads. Parsers that
+ * allocate in proportion to the file size reserve their estimate before
+ * reading the file.
+ */
+typedef struct {
+    // 0 if there is no limit
+    size_t max;
+    size_t used;
+    size_t peak;
+
+    unsigned long wait_count;
+    unsigned long defer_count;
+
+    pthread_mutex_t mu;
+    pthread_cond_t released_cond;
+} mem_budget_t;
+
+void mem_budget_init(mem_budget_t *budget, size_t max);
+
+/**
+ * Reserve size bytes. If wait is FALSE, fail when the memory is not
+ * available right now. Otherwise wait until enough memory is released,
+ * except for reservations larger than the whole budget, which fail
+ * right away and are counted as deferred.
+ *
+ * @return TRUE if the memory was reserved
+ */
+int mem_budget_reserve(mem_budget_t *budget, size_t size, int wait);
+
+void mem_budget_release(mem_budget_t *budget, size_t size);
+
+#endif
@@ -12,6 +12,13 @@
 #define MIN_VIDEO_SIZE (1024 * 64)
 #define MIN_IMAGE_SIZE (512)
 
+// Estimated peak memory usage of the parsers, relative to the file size
+#define RAW_MEM_FACTOR 4
+#define IMAGE_MEM_FACTOR 8
+#define EBOOK_MEM_FACTOR 3
+#define JSON_MEM_FACTOR 4
+#define DOC_MEM_FACTOR 2
+
 int fs_read(struct vfile *f, void *buf, size_t size) {
 
     if (f->fd == -1) {
@@ -48,6 +55,31 @@ void fs_reset(struct vfile *f) {
     }
 }
 
+/**
+ * Memory to reserve from the budget before parsing the file. Media files
+ * inside archives reserve their buffer themselves (see memfile_open()), only
+ * the decoding overhead is reserved here.
+ */
+static size_t estimate_parse_memory(parse_job_t *job, document_t *doc) {
+    int mmime = MAJOR_MIME(doc->mime);
+
+    if (!(SHOULD_PARSE(doc->mime)) || doc->mime == MIME_SIST2_SIDECAR) {
+        return 0;
+    } else if (IS_RAW(doc->mime)) {
+        return doc->size * RAW_MEM_FACTOR;
+    } else if (mmime == MimeImage && doc->size >= MIN_IMAGE_SIZE) {
+        return doc->size * (job->vfile.is_fs_file ? IMAGE_MEM_FACTOR : IMAGE_MEM_FACTOR - 1);
+    } else if (IS_PDF(doc->mime)) {
+        return doc->size * EBOOK_MEM_FACTOR;
+    } else if (is_json(&ScanCtx.json_ctx, doc->mime) || is_ndjson(&ScanCtx.json_ctx, doc->mime)) {
+        return doc->size * JSON_MEM_FACTOR;
+    } else if (IS_FONT(doc->mime) || IS_MOBI(doc->mime) || is_msdoc(&ScanCtx.msdoc_ctx, doc->mime) ||
+               ((ScanCtx.ooxml_ctx.content_size > 0 || ScanCtx.media_ctx.tn_size > 0) && IS_DOC(doc->mime))) {
+        return doc->size * DOC_MEM_FACTOR;
+    }
+    return 0;
+}
+
 void set_dbg_current_file(parse_job_t *job) {
     unsigned long long pid = (unsigned long long) pthread_self();
     pthread_mutex_lock(&ScanCtx.dbg_current_files_mu);
@@ -76,12 +108,12 @@ void parse(void *arg) {
     doc->mime = 0;
     doc->size = job->vfile.info.st_size;
     doc->mtime = (int) job->vfile.info.st_mtim.tv_sec;
+    doc->deferred = FALSE;
 
-    int inc_ts = incremental_get(ScanCtx.original_table, doc->path_md5);
-    if (inc_ts != 0 && inc_ts == job->vfile.info.st_mtim.tv_sec) {
-        pthread_mutex_lock(&ScanCtx.copy_table_mu);
-        incremental_mark_file_for_copy(ScanCtx.copy_table, doc->path_md5);
-        pthread_mutex_unlock(&ScanCtx.copy_table_mu);
+    int inc_ts = inc_table_get(ScanCtx.original_table, doc->path_md5);
+    if (inc_ts != 0 && inc_ts == job->vfile.info.st_mtim.tv_sec &&
+        !inc_table_is_marked(ScanCtx.original_table, doc->path_md5, INC_TABLE_FLAG_DEFERRED)) {
+        inc_table_mark_for_copy(ScanCtx.original_table, doc->path_md5);
 
         pthread_mutex_lock(&ScanCtx.dbg_file_counts_mu);
         ScanCtx.dbg_skipped_files_count += 1;
@@ -154,7 +186,17 @@ void parse(void *arg) {
 
     int mmime = MAJOR_MIME(doc->mime);
 
-    if (!(SHOULD_PARSE(doc->mime))) {
+    // Wait for enough memory, or only index the metadata of the file. It is parsed again by the next
+    // incremental scan.
+    size_t mem_estimate = estimate_parse_memory(job, doc);
+    doc->deferred = mem_estimate > 0 && !mem_budget_reserve(&ScanCtx.mem_budget, mem_estimate, TRUE);
+    if (doc->deferred) {
+        LOG_WARNINGF(job->filepath, "Estimated memory usage (%zuB) exceeds the memory budget, "
+                                    "only indexing the metadata of the file", mem_estimate)
+        mem_estimate = 0;
+    }
+
+    if (!(SHOULD_PARSE(doc->mime)) || doc->deferred) {
 
     } else if (IS_RAW(doc->mime)) {
         parse_raw(&ScanCtx.raw_ctx, &job->vfile, doc);
@@ -190,10 +232,6 @@ void parse(void *arg) {
         parse_mobi(&ScanCtx.mobi_ctx, &job->vfile, doc);
     } else if (doc->mime == MIME_SIST2_SIDECAR) {
         parse_sidecar(&job->vfile, doc);
-        CLOSE_FILE(job->vfile)
-        free(doc->filepath);
-        free(doc);
-        return;
     } else if (is_msdoc(&ScanCtx.msdoc_ctx, doc->mime)) {
         parse_msdoc(&ScanCtx.msdoc_ctx, &job->vfile, doc);
     } else if (is_json(&ScanCtx.json_ctx, doc->mime)) {
@@ -202,6 +240,18 @@ void parse(void *arg) {
         parse_ndjson(&ScanCtx.json_ctx, &job->vfile, doc);
     }
 
+    if (mem_estimate > 0) {
+        mem_budget_release(&ScanCtx.mem_budget, mem_estimate);
+    }
+
+    // Sidecar files are not indexed
+    if (doc->mime == MIME_SIST2_SIDECAR) {
+        CLOSE_FILE(job->vfile)
+        free(doc->filepath);
+        free(doc);
+        return;
+    }
+
     abort:
 
     //Parent meta
@@ -15,6 +15,8 @@ static GHashTable *AggDate;
 static long TotalSize = 0;
 static long DocumentCount = 0;
 
+static pthread_mutex_t TablesMu = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct {
     long size;
     long count;
@@ -42,6 +44,8 @@ void fill_tables(cJSON *document, UNUSED(const char index_id[MD5_STR_LENGTH])) {
     long size = (long) cJSON_GetObjectItem(document, "size")->valuedouble;
     int mtime = cJSON_GetObjectItem(document, "mtime")->valueint;
 
+    pthread_mutex_lock(&TablesMu);
+
     // treemap
     void *existing_path = g_hash_table_lookup(FlatTree, path);
     if (existing_path == NULL) {
@@ -93,6 +97,8 @@ void fill_tables(cJSON *document, UNUSED(const char index_id[MD5_STR_LENGTH])) {
 
     TotalSize += size;
     DocumentCount += 1;
+
+    pthread_mutex_unlock(&TablesMu);
 }
 
 void read_index_into_tables(index_t *index) {
@@ -102,7 +108,7 @@ void read_index_into_tables(index_t *index) {
         if (strncmp(de->d_name, "_index_", sizeof("_index_") - 1) == 0) {
             char file_path[PATH_MAX];
             snprintf(file_path, PATH_MAX, "%s%s", index->path, de->d_name);
-            read_index(file_path, index->desc.id, index->desc.type, fill_tables);
+            read_index_parallel(file_path, &index->desc, fill_tables, ScanCtx.threads);
         }
     }
     closedir(dir);
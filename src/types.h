@@ -2,6 +2,9 @@
 #define SIST2_TYPES_H
 
 #define INDEX_TYPE_NDJSON "ndjson"
+#define INDEX_TYPE_BIN "binary"
+
+#include "libscan/scan.h"
 
 typedef struct index_descriptor {
     char id[MD5_STR_LENGTH];
@@ -12,6 +15,13 @@ typedef struct index_descriptor {
     short root_len;
     char name[1024];
     char type[64];
+    int compression_level;
+    int compression_workers;
+    int compression_ldm;
+    char compression_dict[256];
+    long compression_frame_size;
+    int thumbnail_size;
+    thumbnail_tiers_t thumbnail_tiers;
 } index_descriptor_t;
 
 typedef struct index_t {
@@ -133,11 +133,6 @@ void progress_bar_print(double percentage, size_t tn_size, size_t index_size) {
     PrintingProgressBar = TRUE;
 }
 
-GHashTable *incremental_get_table() {
-    GHashTable *file_table = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
-    return file_table;
-}
-
 const char *find_file_in_paths(const char *paths[], const char *filename) {
 
     for (int i = 0; paths[i] != NULL; i++) {
@@ -136,6 +136,23 @@ void style_vendor(struct mg_connection *nc, struct mg_http_message *hm) {
     mg_send(nc, chunk_vendors_css, sizeof(chunk_vendors_css));
 }
 
+/**
+ * @return the smallest thumbnail tier of the index that is at least size
+ * pixels (the largest one if there is none), 0 for the default size
+ */
+static int thumbnail_tier_size(const index_descriptor_t *desc, int size) {
+    int best = desc->thumbnail_size;
+
+    for (int i = 0; i < desc->thumbnail_tiers.count; i++) {
+        int tier = desc->thumbnail_tiers.sizes[i];
+        if (best < size ? tier > best : (tier >= size && tier < best)) {
+            best = tier;
+        }
+    }
+
+    return best == desc->thumbnail_size ? 0 : best;
+}
+
 void thumbnail(struct mg_connection *nc, struct mg_http_message *hm) {
 
     if (hm->uri.len != 68) {
@@ -155,24 +172,46 @@ void thumbnail(struct mg_connection *nc, struct mg_http_message *hm) {
     unsigned char md5_buf[MD5_DIGEST_LENGTH];
     hex2buf(arg_file_md5, MD5_STR_LENGTH - 1, md5_buf);
 
-    store_t *store = get_store(arg_index);
-    if (store == NULL) {
+    index_t *idx = get_index_by_id(arg_index);
+    if (idx == NULL) {
         LOG_DEBUGF("serve.c", "Could not get store for index: %s", arg_index)
         mg_http_reply(nc, 404, "", "Not found");
         return;
     }
+    store_t *store = idx->store;
 
+    // The thumbnail is sent directly from the map of the store
     size_t data_len = 0;
-    char *data = store_read(store, (char *) md5_buf, sizeof(md5_buf), &data_len);
-    if (data_len != 0) {
+    const char *data = NULL;
+
+    char arg_size[16];
+    if (mg_http_get_var(&hm->query, "s", arg_size, sizeof(arg_size)) > 0) {
+        int tier_size = thumbnail_tier_size(&idx->desc, atoi(arg_size));
+        if (tier_size != 0) {
+            unsigned char tier_key[MD5_DIGEST_LENGTH];
+            thumbnail_tier_key(md5_buf, tier_size, tier_key);
+            data = store_read_begin(store, (char *) tier_key, sizeof(tier_key), &data_len);
+            if (data == NULL) {
+                store_read_end(store);
+            }
+        }
+    }
+
+    // Default size
+    if (data == NULL) {
+        data = store_read_begin(store, (char *) md5_buf, sizeof(md5_buf), &data_len);
+    }
+
+    if (data != NULL) {
         send_response_line(
                 nc, 200, data_len,
                 "Content-Type: image/jpeg\r\n"
                 "Cache-Control: max-age=31536000"
         );
         mg_send(nc, data, data_len);
-        free(data);
+        store_read_end(store);
     } else {
+        store_read_end(store);
         mg_http_reply(nc, 404, "Content-Type: text/plain;charset=utf-8\r\n", "Not found");
         return;
     }
@@ -3,6 +3,11 @@ import subprocess
 import shutil
 import json
 import os
+import struct
+import time
+import urllib.error
+import urllib.request
+import zlib
 
 TEST_FILES = "third-party/libscan/libscan-test-files/test_files"
 
@@ -58,6 +63,75 @@ def sist2_index_to_dict(index):
             yield json.loads(line)
 
 
+def make_text_files(files):
+    path = "/tmp/sist2_test/text_files"
+
+    shutil.rmtree(path, ignore_errors=True)
+    os.makedirs(path)
+    for name, content in files.items():
+        write_text_file(path, name, content)
+    return path
+
+
+def write_text_file(path, name, content):
+    file_path = os.path.join(path, name)
+    mtime = os.path.getmtime(file_path) if os.path.exists(file_path) else None
+
+    with open(file_path, "w") as f:
+        f.write(content)
+
+    # mtimes are compared with a 1s resolution
+    if mtime is not None:
+        os.utime(file_path, (mtime + 10, mtime + 10))
+
+
+def write_png_file(path, name, color, size=64):
+    def chunk(chunk_type, data):
+        return struct.pack(">I", len(data)) + chunk_type + data + \
+               struct.pack(">I", zlib.crc32(chunk_type + data) & 0xffffffff)
+
+    row = b"\x00" + bytes(color) * size
+    with open(os.path.join(path, name), "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n")
+        f.write(chunk(b"IHDR", struct.pack(">IIBBBBB", size, size, 8, 2, 0, 0, 0)))
+        f.write(chunk(b"IDAT", zlib.compress(row * size)))
+        f.write(chunk(b"IEND", b""))
+
+
+class Sist2Web:
+    def __init__(self, index, port=4091):
+        self.url = "http://localhost:%d" % port
+        self.proc = subprocess.Popen(["./sist2_debug", "web", "--bind", "localhost:%d" % port, index])
+
+        with open(os.path.join(index, "descriptor.json")) as f:
+            self.index_id = json.load(f)["id"]
+
+        for _ in range(50):
+            try:
+                urllib.request.urlopen(self.url + "/status")
+                break
+            except Exception:
+                time.sleep(0.2)
+
+    def thumbnail(self, doc_id):
+        try:
+            with urllib.request.urlopen("%s/t/%s/%s" % (self.url, self.index_id, doc_id)) as res:
+                return res.read()
+        except urllib.error.HTTPError:
+            return None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.proc.terminate()
+        self.proc.wait()
+
+
+def contents_by_name(docs):
+    return {doc["_source"]["name"]: doc["_source"].get("content", "").strip() for doc in docs}
+
+
 class ScanTest(unittest.TestCase):
 
     def test_incremental1(self):
@@ -77,6 +151,88 @@ class ScanTest(unittest.TestCase):
         self.assertEqual(sum(1 for _ in sist2_incremental_index(TEST_FILES, remove_files)), file_count - 2)
         self.assertEqual(sum(1 for _ in sist2_incremental_index(TEST_FILES, add_files)), file_count + 3)
 
+    def test_in_place(self):
+        path = make_text_files({"a.txt": "content a", "b.txt": "content b", "c.txt": "content c"})
+
+        shutil.rmtree("test_i_in_place", ignore_errors=True)
+        sist2("scan", path, "-o", "test_i_in_place")
+        self.assertEqual(contents_by_name(sist2_index_to_dict("test_i_in_place")),
+                         {"a": "content a", "b": "content b", "c": "content c"})
+
+        os.remove(os.path.join(path, "b.txt"))
+        write_text_file(path, "c.txt", "modified c")
+        sist2("scan", path, "-o", "test_i_in_place", "--in-place")
+        self.assertEqual(contents_by_name(sist2_index_to_dict("test_i_in_place")),
+                         {"a": "content a", "c": "modified c"})
+
+        os.remove(os.path.join(path, "a.txt"))
+        write_text_file(path, "c.txt", "modified c again")
+        write_text_file(path, "d.txt", "content d")
+        sist2("scan", path, "-o", "test_i_in_place", "--in-place")
+        expected = {"c": "modified c again", "d": "content d"}
+        self.assertEqual(contents_by_name(sist2_index_to_dict("test_i_in_place")), expected)
+
+        sist2("compact", "test_i_in_place")
+        docs = list(sist2_index_to_dict("test_i_in_place"))
+        self.assertEqual(len(docs), 2)
+        self.assertEqual(contents_by_name(docs), expected)
+
+    def test_print_delta(self):
+        path = make_text_files({"a.txt": "content a", "b.txt": "content b", "c.txt": "content c"})
+
+        shutil.rmtree("test_i_delta", ignore_errors=True)
+        shutil.rmtree("test_i_delta_inc", ignore_errors=True)
+        sist2("scan", path, "-o", "test_i_delta")
+        ids = {doc["_source"]["name"]: doc["_id"] for doc in sist2_index_to_dict("test_i_delta")}
+
+        os.remove(os.path.join(path, "b.txt"))
+        write_text_file(path, "c.txt", "modified c")
+        write_text_file(path, "d.txt", "content d")
+        sist2("scan", path, "-o", "test_i_delta_inc", "--incremental", "test_i_delta")
+
+        res = sist2("index", "--print", "--delta", "test_i_delta_inc")
+        lines = [json.loads(line) for line in res.splitlines() if line]
+        docs = [line for line in lines if "_source" in line]
+        deletes = [line["delete"] for line in lines if "delete" in line]
+
+        self.assertEqual(contents_by_name(docs), {"c": "modified c", "d": "content d"})
+        self.assertEqual([d["_id"] for d in deletes], [ids["b"]])
+        self.assertEqual(len(lines), len(docs) + len(deletes))
+
 
 if __name__ == "__main__":
     unittest.main()
+
+    def test_pack_store(self):
+        path = make_text_files({"text.txt": "content text"})
+        write_png_file(path, "red.png", (255, 0, 0))
+        write_png_file(path, "green.png", (0, 255, 0))
+        write_png_file(path, "blue.png", (0, 0, 255))
+
+        shutil.rmtree("test_i_pack", ignore_errors=True)
+        sist2("scan", path, "-o", "test_i_pack", "--thumbnail-store", "pack")
+        self.assertTrue(os.path.exists("test_i_pack/thumbs/pack.index"))
+
+        ids = {doc["_source"]["name"]: doc["_id"] for doc in sist2_index_to_dict("test_i_pack")}
+        self.assertEqual(set(ids), {"text", "red", "green", "blue"})
+
+        with Sist2Web("test_i_pack") as web:
+            thumbnails = {name: web.thumbnail(ids[name]) for name in ("red", "green", "blue")}
+            for name, thumbnail in thumbnails.items():
+                self.assertTrue(thumbnail, name)
+
+        os.remove(os.path.join(path, "red.png"))
+        write_png_file(path, "green.png", (255, 255, 0))
+        mtime = os.path.getmtime(os.path.join(path, "green.png")) + 10
+        os.utime(os.path.join(path, "green.png"), (mtime, mtime))
+        sist2("scan", path, "-o", "test_i_pack", "--in-place")
+
+        docs = list(sist2_index_to_dict("test_i_pack"))
+        self.assertEqual({doc["_source"]["name"] for doc in docs}, {"text", "green", "blue"})
+
+        with Sist2Web("test_i_pack") as web:
+            self.assertIsNone(web.thumbnail(ids["red"]))
+            self.assertEqual(web.thumbnail(ids["blue"]), thumbnails["blue"])
+            green = web.thumbnail(ids["green"])
+            self.assertTrue(green)
+            self.assertNotEqual(green, thumbnails["green"])
@@ -11,6 +11,7 @@ typedef struct {
 
     int tn_size;
     float tn_qscale;
+    thumbnail_tiers_t tn_tiers;
 
     unsigned int cbr_mime;
     unsigned int cbz_mime;
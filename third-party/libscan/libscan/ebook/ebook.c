@@ -38,7 +38,8 @@ int pixmap_is_blank(const fz_pixmap *pixmap) {
 }
 
 fz_pixmap *
-load_pixmap(scan_ebook_ctx_t *ctx, int page, fz_context *fzctx, fz_document *fzdoc, document_t *doc, fz_page **cover) {
+load_pixmap(scan_ebook_ctx_t *ctx, int size, int page, fz_context *fzctx, fz_document *fzdoc, document_t *doc,
+            fz_page **cover) {
 
     int err = 0;
 
@@ -58,9 +59,9 @@ load_pixmap(scan_ebook_ctx_t *ctx, int page, fz_context *fzctx, fz_document *fzd
     float w = bounds.x1 - bounds.x0;
     float h = bounds.y1 - bounds.y0;
     if (w > h) {
-        scale = (float) ctx->tn_size / w;
+        scale = (float) size / w;
     } else {
-        scale = (float) ctx->tn_size / h;
+        scale = (float) size / h;
     }
     fz_matrix m = fz_scale(scale, scale);
 
@@ -96,31 +97,18 @@ load_pixmap(scan_ebook_ctx_t *ctx, int page, fz_context *fzctx, fz_document *fzd
     return pixmap;
 }
 
-int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_document *fzdoc) {
-
-    fz_page *cover = NULL;
-    fz_pixmap *pixmap = load_pixmap(ctx, 0, fzctx, fzdoc, doc, &cover);
-    if (pixmap == NULL) {
-        return FALSE;
-    }
-
-    if (pixmap_is_blank(pixmap)) {
-        fz_drop_page(fzctx, cover);
-        fz_drop_pixmap(fzctx, pixmap);
-        CTX_LOG_DEBUG(doc->filepath, "Cover page is blank, using page 1 instead")
-        pixmap = load_pixmap(ctx, 1, fzctx, fzdoc, doc, &cover);
-        if (pixmap == NULL) {
-            return FALSE;
-        }
-    }
+/**
+ * Encode the pixmap to jpeg and store it
+ */
+static void store_pixmap(scan_ebook_ctx_t *ctx, fz_pixmap *pixmap, const unsigned char key[MD5_DIGEST_LENGTH]) {
 
     // RGB24 -> YUV420p
     AVFrame *scaled_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
+    struct SwsContext *sws_ctx = get_sws_context(
             pixmap->w, pixmap->h, AV_PIX_FMT_RGB24,
             pixmap->w, pixmap->h, AV_PIX_FMT_YUV420P,
-            SIST_SWS_ALGO, 0, 0, 0
+            SIST_SWS_ALGO
     );
 
     int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, pixmap->w, pixmap->h, 1);
@@ -145,28 +133,64 @@ int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_d
     scaled_frame->height = pixmap->h;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
-
     // YUV420p -> JPEG
-    AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(pixmap->w, pixmap->h, ctx->tn_qscale);
+    AVCodecContext *jpeg_encoder = get_jpeg_encoder(pixmap->w, pixmap->h, ctx->tn_qscale);
     avcodec_send_frame(jpeg_encoder, scaled_frame);
 
     AVPacket jpeg_packet;
     av_init_packet(&jpeg_packet);
     avcodec_receive_packet(jpeg_encoder, &jpeg_packet);
 
-    APPEND_TN_META(doc, pixmap->w, pixmap->h)
-    ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
+    ctx->store((char *) key, MD5_DIGEST_LENGTH, (char *) jpeg_packet.data, jpeg_packet.size);
 
     free(samples);
     av_packet_unref(&jpeg_packet);
     av_free(*scaled_frame->data);
     av_frame_free(&scaled_frame);
-    avcodec_free_context(&jpeg_encoder);
+}
+
+int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_document *fzdoc) {
+
+    int page = 0;
+    fz_page *cover = NULL;
+    fz_pixmap *pixmap = load_pixmap(ctx, ctx->tn_size, page, fzctx, fzdoc, doc, &cover);
+    if (pixmap == NULL) {
+        return FALSE;
+    }
+
+    if (pixmap_is_blank(pixmap)) {
+        fz_drop_page(fzctx, cover);
+        fz_drop_pixmap(fzctx, pixmap);
+        CTX_LOG_DEBUG(doc->filepath, "Cover page is blank, using page 1 instead")
+        page = 1;
+        pixmap = load_pixmap(ctx, ctx->tn_size, page, fzctx, fzdoc, doc, &cover);
+        if (pixmap == NULL) {
+            return FALSE;
+        }
+    }
+
+    APPEND_TN_META(doc, pixmap->w, pixmap->h)
+    store_pixmap(ctx, pixmap, doc->path_md5);
 
     fz_drop_pixmap(fzctx, pixmap);
     fz_drop_page(fzctx, cover);
 
+    // The page is rendered again at the size of each tier
+    for (int i = 0; i < ctx->tn_tiers.count; i++) {
+        fz_page *tier_page = NULL;
+        fz_pixmap *tier_pixmap = load_pixmap(ctx, ctx->tn_tiers.sizes[i], page, fzctx, fzdoc, doc, &tier_page);
+        if (tier_pixmap == NULL) {
+            continue;
+        }
+
+        unsigned char tier_key[MD5_DIGEST_LENGTH];
+        thumbnail_tier_key(doc->path_md5, ctx->tn_tiers.sizes[i], tier_key);
+        store_pixmap(ctx, tier_pixmap, tier_key);
+
+        fz_drop_pixmap(fzctx, tier_pixmap);
+        fz_drop_page(fzctx, tier_page);
+    }
+
     return TRUE;
 }
 
@@ -15,6 +15,7 @@ typedef struct {
     store_callback_t store;
     int fast_epub_parse;
     float tn_qscale;
+    thumbnail_tiers_t tn_tiers;
 } scan_ebook_ctx_t;
 
 void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, document_t *doc);
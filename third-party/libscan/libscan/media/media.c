@@ -1,6 +1,11 @@
 #include "media.h"
 #include "../ocr/ocr.h"
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
 
 #define MIN_SIZE 32
 #define AVIO_BUF_SIZE 8192
@@ -13,6 +18,188 @@
 // Pointer to document being processed
 __thread document_t *thread_doc;
 
+/*
+ * Scaling contexts and jpeg encoders are reused between the documents parsed
+ * by a thread. They are freed by cleanup_media().
+ */
+#define SWS_CACHE_SIZE 4
+#define JPEG_ENCODER_CACHE_SIZE 8
+
+typedef struct {
+    struct SwsContext *sws_ctx;
+    int src_w;
+    int src_h;
+    enum AVPixelFormat src_fmt;
+    int dst_w;
+    int dst_h;
+    enum AVPixelFormat dst_fmt;
+    int flags;
+    unsigned long last_used;
+} cached_sws_ctx_t;
+
+typedef struct {
+    AVCodecContext *encoder;
+    int w;
+    int h;
+    float qscale;
+    unsigned long last_used;
+} cached_jpeg_encoder_t;
+
+static __thread cached_sws_ctx_t SwsCache[SWS_CACHE_SIZE];
+static __thread cached_jpeg_encoder_t JpegEncoderCache[JPEG_ENCODER_CACHE_SIZE];
+static __thread unsigned long CacheClock = 0;
+
+struct SwsContext *get_sws_context(int src_w, int src_h, enum AVPixelFormat src_fmt,
+                                   int dst_w, int dst_h, enum AVPixelFormat dst_fmt, int flags) {
+    CacheClock += 1;
+
+    cached_sws_ctx_t *lru = &SwsCache[0];
+    for (int i = 0; i < SWS_CACHE_SIZE; i++) {
+        cached_sws_ctx_t *entry = &SwsCache[i];
+        if (entry->sws_ctx != NULL && entry->src_w == src_w && entry->src_h == src_h && entry->src_fmt == src_fmt &&
+            entry->dst_w == dst_w && entry->dst_h == dst_h && entry->dst_fmt == dst_fmt && entry->flags == flags) {
+            entry->last_used = CacheClock;
+            return entry->sws_ctx;
+        }
+        if (entry->last_used < lru->last_used) {
+            lru = entry;
+        }
+    }
+
+    // Replaces the least recently used context
+    lru->sws_ctx = sws_getCachedContext(lru->sws_ctx, src_w, src_h, src_fmt, dst_w, dst_h, dst_fmt, flags,
+                                        NULL, NULL, NULL);
+    lru->src_w = src_w;
+    lru->src_h = src_h;
+    lru->src_fmt = src_fmt;
+    lru->dst_w = dst_w;
+    lru->dst_h = dst_h;
+    lru->dst_fmt = dst_fmt;
+    lru->flags = flags;
+    lru->last_used = CacheClock;
+
+    return lru->sws_ctx;
+}
+
+AVCodecContext *get_jpeg_encoder(int w, int h, float qscale) {
+    CacheClock += 1;
+
+    cached_jpeg_encoder_t *lru = &JpegEncoderCache[0];
+    for (int i = 0; i < JPEG_ENCODER_CACHE_SIZE; i++) {
+        cached_jpeg_encoder_t *entry = &JpegEncoderCache[i];
+        if (entry->encoder != NULL && entry->w == w && entry->h == h && entry->qscale == qscale) {
+            entry->last_used = CacheClock;
+            return entry->encoder;
+        }
+        if (entry->last_used < lru->last_used) {
+            lru = entry;
+        }
+    }
+
+    if (lru->encoder != NULL) {
+        avcodec_free_context(&lru->encoder);
+    }
+
+    lru->encoder = alloc_jpeg_encoder(w, h, qscale);
+    lru->w = w;
+    lru->h = h;
+    lru->qscale = qscale;
+    lru->last_used = CacheClock;
+
+    return lru->encoder;
+}
+
+#define MAX_TN_STATS_CODECS 64
+
+typedef struct {
+    enum AVCodecID codec_id;
+    unsigned long count;
+    unsigned long keyframe_fallback_count;
+    double time;
+} tn_codec_stats_t;
+
+static tn_codec_stats_t TnStats[MAX_TN_STATS_CODECS];
+static int TnStatsCount = 0;
+static pthread_mutex_t TnStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long ProbeFilesCount = 0;
+static unsigned long ProbeSkippedCount = 0;
+static unsigned long long ProbeBytesRead = 0;
+
+// Memory used by all threads to buffer media files inside archives
+static long MediaBufferUsed = 0;
+static long MediaBufferPeak = 0;
+static unsigned long MediaBufferSpilledCount = 0;
+
+static void add_thumbnail_stats(enum AVCodecID codec_id, const struct timespec *start, int keyframe_fallback) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = (double) (end.tv_sec - start->tv_sec) + (double) (end.tv_nsec - start->tv_nsec) / 1e9;
+
+    pthread_mutex_lock(&TnStatsMutex);
+    tn_codec_stats_t *stats = NULL;
+    for (int i = 0; i < TnStatsCount; i++) {
+        if (TnStats[i].codec_id == codec_id) {
+            stats = &TnStats[i];
+            break;
+        }
+    }
+    if (stats == NULL && TnStatsCount < MAX_TN_STATS_CODECS) {
+        stats = &TnStats[TnStatsCount++];
+        stats->codec_id = codec_id;
+    }
+    if (stats != NULL) {
+        stats->count += 1;
+        stats->keyframe_fallback_count += keyframe_fallback;
+        stats->time += time;
+    }
+    pthread_mutex_unlock(&TnStatsMutex);
+}
+
+static void add_probe_stats(int64_t bytes_read, int skipped_stream_info) {
+    pthread_mutex_lock(&TnStatsMutex);
+    ProbeFilesCount += 1;
+    ProbeSkippedCount += skipped_stream_info;
+    ProbeBytesRead += bytes_read;
+    pthread_mutex_unlock(&TnStatsMutex);
+}
+
+void media_log_stats(scan_media_ctx_t *ctx) {
+    if (MediaBufferPeak > 0 || MediaBufferSpilledCount > 0) {
+        CTX_LOG_INFOF("media.c", "Media files inside archives: %.2fMB peak memory buffer, %lu spilled to disk",
+                      (double) MediaBufferPeak / (1024 * 1024), MediaBufferSpilledCount)
+    }
+
+    pthread_mutex_lock(&TnStatsMutex);
+    if (ProbeFilesCount > 0) {
+        CTX_LOG_INFOF("media.c", "Media files: %lu, %.2fMB read (%.1fKB avg), stream probing skipped for %lu files",
+                      ProbeFilesCount, (double) ProbeBytesRead / (1024 * 1024),
+                      (double) ProbeBytesRead / 1024 / (double) ProbeFilesCount, ProbeSkippedCount)
+    }
+    for (int i = 0; i < TnStatsCount; i++) {
+        CTX_LOG_INFOF("media.c", "Video thumbnails (%s): %lu in %.2fs (%.1fms avg), %lu keyframe fallbacks",
+                      avcodec_get_name(TnStats[i].codec_id), TnStats[i].count, TnStats[i].time,
+                      TnStats[i].time * 1000 / (double) TnStats[i].count, TnStats[i].keyframe_fallback_count)
+    }
+    pthread_mutex_unlock(&TnStatsMutex);
+}
+
+void cleanup_media() {
+    for (int i = 0; i < SWS_CACHE_SIZE; i++) {
+        if (SwsCache[i].sws_ctx != NULL) {
+            sws_freeContext(SwsCache[i].sws_ctx);
+            SwsCache[i].sws_ctx = NULL;
+        }
+        SwsCache[i].last_used = 0;
+    }
+    for (int i = 0; i < JPEG_ENCODER_CACHE_SIZE; i++) {
+        if (JpegEncoderCache[i].encoder != NULL) {
+            avcodec_free_context(&JpegEncoderCache[i].encoder);
+        }
+        JpegEncoderCache[i].last_used = 0;
+    }
+}
+
 const char *get_filepath_with_ext(document_t *doc, const char *filepath, const char *mime_str) {
 
     int has_extension = doc->ext > doc->base;
@@ -39,7 +226,8 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
     int dstW;
     int dstH;
     if (frame->width <= size && frame->height <= size) {
-        if (decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) {
+        // The packet of a reduced resolution frame is the full size image
+        if ((decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) && decoder->lowres == 0) {
             return STORE_AS_IS;
         }
 
@@ -62,10 +250,10 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
 
     AVFrame *scaled_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
-            decoder->width, decoder->height, decoder->pix_fmt,
+    struct SwsContext *sws_ctx = get_sws_context(
+            frame->width, frame->height, decoder->pix_fmt,
             dstW, dstH, AV_PIX_FMT_YUVJ420P,
-            SIST_SWS_ALGO, 0, 0, 0
+            SIST_SWS_ALGO
     );
 
     int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, dstW, dstH, 1);
@@ -75,7 +263,7 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
 
     sws_scale(sws_ctx,
               (const uint8_t *const *) frame->data, frame->linesize,
-              0, decoder->height,
+              0, frame->height,
               scaled_frame->data, scaled_frame->linesize
     );
 
@@ -83,11 +271,35 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
     scaled_frame->height = dstH;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
-
     return scaled_frame;
 }
 
+/**
+ * Largest lowres factor of the decoder (the image is decoded at 1/2^lowres
+ * of its size, only MJPEG supports it) that keeps the image at least as large
+ * as the largest thumbnail. Scaling the decoded frame only finishes the
+ * remaining ratio.
+ */
+static int thumbnail_lowres(int tn_size, const thumbnail_tiers_t *tn_tiers, const AVCodec *codec,
+                            const AVCodecParameters *params) {
+    if (codec == NULL) {
+        return 0;
+    }
+
+    int target_size = tn_size;
+    for (int i = 0; i < tn_tiers->count; i++) {
+        target_size = MAX(target_size, tn_tiers->sizes[i]);
+    }
+
+    int size = MAX(params->width, params->height);
+    int lowres = 0;
+    while (lowres < codec->max_lowres && (size >> (lowres + 1)) >= target_size) {
+        lowres += 1;
+    }
+
+    return lowres;
+}
+
 typedef struct {
     AVPacket *packet;
     AVFrame *frame;
@@ -106,11 +318,69 @@ static void frame_and_packet_free(frame_and_packet_t *frame_and_packet) {
     free(frame_and_packet);
 }
 
-__always_inline
-static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, int stream_idx, document_t *doc) {
+/**
+ * Store the thumbnail tiers of a decoded frame. A tier larger than the frame
+ * is the frame at its original size.
+ */
+static void store_thumbnail_tiers(scan_media_ctx_t *ctx, const AVCodecContext *decoder,
+                                  const frame_and_packet_t *frame_and_packet, document_t *doc) {
+
+    for (int i = 0; i < ctx->tn_tiers.count; i++) {
+        unsigned char tier_key[MD5_DIGEST_LENGTH];
+        thumbnail_tier_key(doc->path_md5, ctx->tn_tiers.sizes[i], tier_key);
+
+        AVFrame *scaled_frame = scale_frame(decoder, frame_and_packet->frame, ctx->tn_tiers.sizes[i]);
+
+        if (scaled_frame == NULL) {
+            continue;
+        }
+
+        if (scaled_frame == STORE_AS_IS) {
+            ctx->store((char *) tier_key, sizeof(tier_key), (char *) frame_and_packet->packet->data,
+                       frame_and_packet->packet->size);
+            continue;
+        }
+
+        AVCodecContext *jpeg_encoder = get_jpeg_encoder(scaled_frame->width, scaled_frame->height,
+                                                        ctx->tn_qscale);
+        avcodec_send_frame(jpeg_encoder, scaled_frame);
+
+        AVPacket jpeg_packet;
+        av_init_packet(&jpeg_packet);
+        avcodec_receive_packet(jpeg_encoder, &jpeg_packet);
+
+        ctx->store((char *) tier_key, sizeof(tier_key), (char *) jpeg_packet.data, jpeg_packet.size);
+
+        av_packet_unref(&jpeg_packet);
+        av_free(*scaled_frame->data);
+        av_frame_free(&scaled_frame);
+    }
+}
+
+/**
+ * Read the subtitles stream in a single pass. All other streams are discarded,
+ * except the tn_stream_idx video stream (if != -1) until its first keyframe
+ * after the thumbnail position is found.
+ *
+ * @return a copy of the thumbnail keyframe packet, or NULL
+ */
+static AVPacket *read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, int stream_idx,
+                                int tn_stream_idx, document_t *doc) {
 
     text_buffer_t tex = text_buffer_create(-1);
 
+    for (int i = 0; i < pFormatCtx->nb_streams; i++) {
+        if (i != stream_idx && i != tn_stream_idx) {
+            pFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVPacket *tn_packet = NULL;
+    int64_t tn_pts = 0;
+    if (tn_stream_idx != -1 && pFormatCtx->streams[tn_stream_idx]->duration != AV_NOPTS_VALUE) {
+        tn_pts = (int64_t) ((double) pFormatCtx->streams[tn_stream_idx]->duration * 0.10);
+    }
+
     AVPacket packet;
     AVSubtitle subtitle;
 
@@ -130,6 +400,17 @@ static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, i
             break;
         }
 
+        if (packet.stream_index == tn_stream_idx) {
+            int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+
+            if (tn_packet == NULL && (packet.flags & AV_PKT_FLAG_KEY) && pts != AV_NOPTS_VALUE && pts >= tn_pts) {
+                tn_packet = av_packet_clone(&packet);
+                pFormatCtx->streams[tn_stream_idx]->discard = AVDISCARD_ALL;
+            }
+            av_packet_unref(&packet);
+            continue;
+        }
+
         if (packet.stream_index != stream_idx) {
             av_packet_unref(&packet);
             continue;
@@ -157,11 +438,91 @@ static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, i
         av_packet_unref(&packet);
     }
 
+    for (int i = 0; i < pFormatCtx->nb_streams; i++) {
+        pFormatCtx->streams[i]->discard = AVDISCARD_DEFAULT;
+    }
+
     text_buffer_terminate_string(&tex);
 
     APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf)
     text_buffer_destroy(&tex);
     avcodec_free_context(&decoder);
+
+    return tn_packet;
+}
+
+/**
+ * Read the subtitles of a .srt/.ass/... file next to the media file
+ *
+ * @return TRUE if a subtitles file was read
+ */
+static int read_sidecar_subtitles(scan_media_ctx_t *ctx, const char *filepath, document_t *doc) {
+    static const char *extensions[] = {".srt", ".ass", ".ssa", ".vtt"};
+
+    const char *base = strrchr(filepath, '/');
+    const char *ext = strrchr(base == NULL ? filepath : base, '.');
+    size_t stem_len = ext == NULL ? strlen(filepath) : ext - filepath;
+
+    char sidecar_path[PATH_MAX];
+    if (stem_len + 5 > sizeof(sidecar_path)) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        memcpy(sidecar_path, filepath, stem_len);
+        strcpy(sidecar_path + stem_len, extensions[i]);
+
+        if (access(sidecar_path, R_OK) != 0) {
+            continue;
+        }
+
+        AVFormatContext *pFormatCtx = NULL;
+        if (avformat_open_input(&pFormatCtx, sidecar_path, NULL, NULL) != 0) {
+            continue;
+        }
+
+        int subtitle_stream = av_find_best_stream(pFormatCtx, AVMEDIA_TYPE_SUBTITLE, -1, -1, NULL, 0);
+        if (subtitle_stream >= 0) {
+            CTX_LOG_DEBUGF(doc->filepath, "(media.c) Reading subtitles from %s", sidecar_path)
+            read_subtitles(ctx, pFormatCtx, subtitle_stream, -1, doc);
+        }
+        avformat_close_input(&pFormatCtx);
+
+        if (subtitle_stream >= 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Decode a single (key) frame
+ */
+static frame_and_packet_t *decode_packet(AVCodecContext *decoder, AVPacket *packet) {
+
+    frame_and_packet_t *result = calloc(1, sizeof(frame_and_packet_t));
+    result->packet = packet;
+    result->frame = av_frame_alloc();
+
+    if (avcodec_send_packet(decoder, packet) != 0) {
+        frame_and_packet_free(result);
+        return NULL;
+    }
+
+    int receive_ret = avcodec_receive_frame(decoder, result->frame);
+    if (receive_ret == AVERROR(EAGAIN)) {
+        // Flush the decoder (frame threading and B-frame delay)
+        avcodec_send_packet(decoder, NULL);
+        receive_ret = avcodec_receive_frame(decoder, result->frame);
+    }
+
+    if (receive_ret != 0) {
+        frame_and_packet_free(result);
+        return NULL;
+    }
+
+    return result;
 }
 
 __always_inline
@@ -288,10 +649,13 @@ append_video_meta(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVFrame *f
         }
         APPEND_META(doc, meta_duration)
 
-        meta_line_t *meta_bitrate = malloc(sizeof(meta_line_t));
-        meta_bitrate->key = MetaMediaBitrate;
-        meta_bitrate->long_val = pFormatCtx->bit_rate;
-        APPEND_META(doc, meta_bitrate)
+        // Unknown when avformat_find_stream_info() is skipped
+        if (pFormatCtx->bit_rate > 0) {
+            meta_line_t *meta_bitrate = malloc(sizeof(meta_line_t));
+            meta_bitrate->key = MetaMediaBitrate;
+            meta_bitrate->long_val = pFormatCtx->bit_rate;
+            APPEND_META(doc, meta_bitrate)
+        }
     }
 
     AVDictionaryEntry *tag = NULL;
@@ -362,10 +726,10 @@ void ocr_image(scan_media_ctx_t *ctx, document_t *doc, const AVCodecContext *dec
     // Convert to RGB32
     AVFrame *rgb_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
+    struct SwsContext *sws_ctx = get_sws_context(
             frame->width, frame->height, decoder->pix_fmt,
             frame->width, frame->height, OCR_PIXEL_FORMAT,
-            SWS_LANCZOS, 0, 0, 0
+            SWS_LANCZOS
     );
 
     int dst_buf_len = av_image_get_buffer_size(OCR_PIXEL_FORMAT, frame->width, frame->height, 1);
@@ -393,18 +757,83 @@ void ocr_image(scan_media_ctx_t *ctx, document_t *doc, const AVCodecContext *dec
             ocr_image_cb
     );
 
-    sws_freeContext(sws_ctx);
     av_free(*rgb_frame->data);
     av_frame_free(&rgb_frame);
 }
 
-void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc) {
+static void set_probe_limits(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx) {
+    if (ctx->probe_size > 0) {
+        pFormatCtx->probesize = ctx->probe_size;
+    }
+    if (ctx->analyze_duration > 0) {
+        pFormatCtx->max_analyze_duration = ctx->analyze_duration;
+    }
+}
+
+/**
+ * @return TRUE if the container header already gives the duration and
+ *          the parameters of the streams that we read.
+ */
+static int header_has_stream_info(AVFormatContext *pFormatCtx) {
+    if (pFormatCtx->nb_streams == 0) {
+        return FALSE;
+    }
+
+    int64_t stream_duration = AV_NOPTS_VALUE;
+    for (int i = 0; i < pFormatCtx->nb_streams; i++) {
+        AVStream *stream = pFormatCtx->streams[i];
+        AVCodecParameters *par = stream->codecpar;
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (par->codec_id == AV_CODEC_ID_NONE || par->width <= 0 || par->height <= 0) {
+                return FALSE;
+            }
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate <= 0 || par->channels <= 0) {
+                return FALSE;
+            }
+        } else {
+            continue;
+        }
+
+        if (stream->duration != AV_NOPTS_VALUE && stream_duration == AV_NOPTS_VALUE) {
+            stream_duration = av_rescale_q(stream->duration, stream->time_base, AV_TIME_BASE_Q);
+        }
+    }
+
+    // The container duration is normally estimated by avformat_find_stream_info(). Audio files without
+    // a duration in their header (raw MP3 without Xing/VBRI header, ADTS AAC) must be probed.
+    if (pFormatCtx->duration == AV_NOPTS_VALUE) {
+        pFormatCtx->duration = stream_duration;
+    }
+    return pFormatCtx->duration != AV_NOPTS_VALUE;
+}
+
+static void close_media_input(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc,
+                              int skipped_stream_info) {
+    if (pFormatCtx->pb != NULL) {
+        CTX_LOG_DEBUGF(doc->filepath, "(media.c) Read %ldB from media file", (long) pFormatCtx->pb->bytes_read)
+        add_probe_stats(pFormatCtx->pb->bytes_read, skipped_stream_info);
+    }
+
+    avformat_close_input(&pFormatCtx);
+    avformat_free_context(pFormatCtx);
+}
+
+/**
+ * @param filepath path of the media file on disk, to look for subtitles files next to it. Can be NULL
+ */
+void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc,
+                            const char *filepath) {
 
     int video_stream = -1;
     int audio_stream = -1;
     int subtitle_stream = -1;
 
-    avformat_find_stream_info(pFormatCtx, NULL);
+    int skipped_stream_info = ctx->fast_probe && header_has_stream_info(pFormatCtx);
+    if (!skipped_stream_info) {
+        avformat_find_stream_info(pFormatCtx, NULL);
+    }
 
     for (int i = (int) pFormatCtx->nb_streams - 1; i >= 0; i--) {
         AVStream *stream = pFormatCtx->streams[i];
@@ -445,11 +874,26 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         }
     }
 
-    if (subtitle_stream != -1 && ctx->read_subtitles) {
-        read_subtitles(ctx, pFormatCtx, subtitle_stream, doc);
+    int has_sidecar_subtitles = FALSE;
+    if (ctx->read_subtitles && filepath != NULL && video_stream != -1 && IS_VIDEO(pFormatCtx)) {
+        has_sidecar_subtitles = read_sidecar_subtitles(ctx, filepath, doc);
+    }
+
+    AVPacket *tn_packet = NULL;
+    if (subtitle_stream != -1 && ctx->read_subtitles && !has_sidecar_subtitles) {
+        int tn_stream = -1;
+        if (video_stream != -1 && ctx->tn_size > 0) {
+            AVStream *stream = pFormatCtx->streams[video_stream];
+            if (!STREAM_IS_IMAGE && stream->codecpar->codec_id != AV_CODEC_ID_GIF) {
+                tn_stream = video_stream;
+            }
+        }
+
+        // Capture the thumbnail keyframe in the same pass
+        tn_packet = read_subtitles(ctx, pFormatCtx, subtitle_stream, tn_stream, doc);
 
         // Reset stream
-        if (video_stream != -1) {
+        if (video_stream != -1 && tn_packet == NULL) {
             av_seek_frame(pFormatCtx, video_stream, 0, 0);
         }
     }
@@ -462,8 +906,8 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         AVStream *stream = pFormatCtx->streams[video_stream];
 
         if (stream->codecpar->width <= MIN_SIZE || stream->codecpar->height <= MIN_SIZE) {
-            avformat_close_input(&pFormatCtx);
-            avformat_free_context(pFormatCtx);
+            av_packet_free(&tn_packet);
+            close_media_input(ctx, pFormatCtx, doc, skipped_stream_info);
             return;
         }
 
@@ -471,10 +915,47 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         AVCodec *video_codec = avcodec_find_decoder(stream->codecpar->codec_id);
         AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
         avcodec_parameters_to_context(decoder, stream->codecpar);
+        // OCR needs the full resolution
+        if (ctx->tesseract_lang == NULL || !STREAM_IS_IMAGE) {
+            decoder->lowres = thumbnail_lowres(ctx->tn_size, &ctx->tn_tiers, video_codec, stream->codecpar);
+        }
         avcodec_open2(decoder, video_codec, NULL);
 
+        int is_video_tn = !STREAM_IS_IMAGE && stream->codecpar->codec_id != AV_CODEC_ID_GIF;
+        int keyframe_fallback = FALSE;
+        struct timespec tn_start;
+        clock_gettime(CLOCK_MONOTONIC, &tn_start);
+
+        frame_and_packet_t *frame_and_packet = NULL;
+        if (tn_packet != NULL) {
+            frame_and_packet = decode_packet(decoder, tn_packet);
+            tn_packet = NULL;
+
+            if (frame_and_packet == NULL) {
+                CTX_LOG_DEBUG(doc->filepath, "(media.c) Could not decode the keyframe read with the subtitles")
+                keyframe_fallback = TRUE;
+                avcodec_flush_buffers(decoder);
+            }
+        }
+
+        if (frame_and_packet == NULL && is_video_tn && ctx->fast_video_tn) {
+            // Only decode the keyframe before the seek position
+            decoder->skip_frame = AVDISCARD_NONKEY;
+            if (av_seek_frame(pFormatCtx, video_stream, (long) ((double) stream->duration * 0.10),
+                              AVSEEK_FLAG_BACKWARD) == 0) {
+                frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
+            }
+
+            if (frame_and_packet == NULL) {
+                CTX_LOG_DEBUG(doc->filepath, "(media.c) Could not decode a keyframe, decoding all frames instead")
+                keyframe_fallback = TRUE;
+                decoder->skip_frame = AVDISCARD_DEFAULT;
+                avcodec_flush_buffers(decoder);
+            }
+        }
+
         //Seek
-        if (!STREAM_IS_IMAGE && stream->codecpar->codec_id != AV_CODEC_ID_GIF) {
+        if (frame_and_packet == NULL && is_video_tn) {
             int seek_ret;
             for (int i = 20; i >= 0; i--) {
                 seek_ret = av_seek_frame(pFormatCtx, video_stream,
@@ -485,11 +966,12 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
             }
         }
 
-        frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
+        if (frame_and_packet == NULL) {
+            frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
+        }
         if (frame_and_packet == NULL) {
             avcodec_free_context(&decoder);
-            avformat_close_input(&pFormatCtx);
-            avformat_free_context(pFormatCtx);
+            close_media_input(ctx, pFormatCtx, doc, skipped_stream_info);
             return;
         }
 
@@ -506,8 +988,7 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         if (scaled_frame == NULL) {
             frame_and_packet_free(frame_and_packet);
             avcodec_free_context(&decoder);
-            avformat_close_input(&pFormatCtx);
-            avformat_free_context(pFormatCtx);
+            close_media_input(ctx, pFormatCtx, doc, skipped_stream_info);
             return;
         }
 
@@ -517,8 +998,8 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
                        frame_and_packet->packet->size);
         } else {
             // Encode frame to jpeg
-            AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(scaled_frame->width, scaled_frame->height,
-                                                              ctx->tn_qscale);
+            AVCodecContext *jpeg_encoder = get_jpeg_encoder(scaled_frame->width, scaled_frame->height,
+                                                            ctx->tn_qscale);
             avcodec_send_frame(jpeg_encoder, scaled_frame);
 
             AVPacket jpeg_packet;
@@ -529,18 +1010,23 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
             APPEND_TN_META(doc, scaled_frame->width, scaled_frame->height)
             ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
 
-            avcodec_free_context(&jpeg_encoder);
             av_packet_unref(&jpeg_packet);
             av_free(*scaled_frame->data);
             av_frame_free(&scaled_frame);
         }
 
+        store_thumbnail_tiers(ctx, decoder, frame_and_packet, doc);
+
+        if (is_video_tn) {
+            add_thumbnail_stats(stream->codecpar->codec_id, &tn_start, keyframe_fallback);
+        }
+
         frame_and_packet_free(frame_and_packet);
         avcodec_free_context(&decoder);
     }
 
-    avformat_close_input(&pFormatCtx);
-    avformat_free_context(pFormatCtx);
+    av_packet_free(&tn_packet);
+    close_media_input(ctx, pFormatCtx, doc, skipped_stream_info);
 }
 
 void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_t *doc) {
@@ -550,6 +1036,8 @@ void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_
         CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()")
         return;
     }
+    set_probe_limits(ctx, pFormatCtx);
+
     int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
     if (res < 0) {
         CTX_LOG_ERRORF(doc->filepath, "(media.c) avformat_open_input() returned [%d] %s", res, av_err2str(res))
@@ -558,7 +1046,7 @@ void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_
         return;
     }
 
-    parse_media_format_ctx(ctx, pFormatCtx, doc);
+    parse_media_format_ctx(ctx, pFormatCtx, doc, filepath);
 }
 
 int vfile_read(void *ptr, uint8_t *buf, int buf_size) {
@@ -576,8 +1064,34 @@ typedef struct {
     size_t size;
     FILE *file;
     void *buf;
+    size_t reserved;
+    mem_release_callback_t mem_release;
 } memfile_t;
 
+#define SPILL_BUF_SIZE (1024 * 1024)
+
+// The file was partially read, it cannot be read sequentially instead
+#define MEMFILE_READ_ERROR (-2)
+
+static int media_buffer_reserve(scan_media_ctx_t *ctx, long size) {
+    long used = __atomic_load_n(&MediaBufferUsed, __ATOMIC_RELAXED);
+    do {
+        if (used + size > ctx->max_media_buffer) {
+            return FALSE;
+        }
+    } while (!__atomic_compare_exchange_n(&MediaBufferUsed, &used, used + size, TRUE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    long peak = __atomic_load_n(&MediaBufferPeak, __ATOMIC_RELAXED);
+    while (used + size > peak && !__atomic_compare_exchange_n(&MediaBufferPeak, &peak, used + size, TRUE,
+                                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return TRUE;
+}
+
+static void media_buffer_release(long size) {
+    __atomic_fetch_sub(&MediaBufferUsed, size, __ATOMIC_RELAXED);
+}
+
 int memfile_read(void *ptr, uint8_t *buf, int buf_size) {
     memfile_t *mem = ptr;
 
@@ -605,9 +1119,95 @@ long memfile_seek(void *ptr, long offset, int whence) {
     return ftell(mem->file);
 }
 
-int memfile_open(vfile_t *f, memfile_t *mem) {
+/**
+ * Copy the file to an unlinked temporary file
+ *
+ * @return 0 on success, -1 if nothing was read, MEMFILE_READ_ERROR otherwise
+ */
+static int memfile_open_spill(scan_media_ctx_t *ctx, vfile_t *f, memfile_t *mem) {
+    char tmp_path[PATH_MAX];
+    if (ctx->spill_dir != NULL) {
+        snprintf(tmp_path, sizeof(tmp_path), "%ssist2-media-XXXXXX", ctx->spill_dir);
+    } else {
+        const char *tmp_dir = getenv("TMPDIR");
+        snprintf(tmp_path, sizeof(tmp_path), "%s/sist2-media-XXXXXX", tmp_dir != NULL ? tmp_dir : "/tmp");
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        CTX_LOG_WARNINGF(f->filepath, "(media.c) Could not create temporary file in %s: %s",
+                         tmp_path, strerror(errno))
+        return -1;
+    }
+    unlink(tmp_path);
+
+    mem->file = fdopen(fd, "w+b");
+    if (mem->file == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    if (f->calculate_checksum) {
+        SHA1_Init(&f->sha1_ctx);
+    }
+
+    void *buf = malloc(SPILL_BUF_SIZE);
+    size_t total = 0;
+    while (total < mem->size) {
+        int ret = f->read(f, buf, SPILL_BUF_SIZE);
+        if (ret <= 0) {
+            break;
+        }
+        if (fwrite(buf, 1, ret, mem->file) != ret) {
+            CTX_LOG_ERRORF(f->filepath, "(media.c) Could not write temporary file: %s", strerror(errno))
+            break;
+        }
+        if (f->calculate_checksum) {
+            safe_sha1_update(&f->sha1_ctx, buf, ret);
+        }
+        total += ret;
+    }
+    free(buf);
+
+    if (f->calculate_checksum) {
+        SHA1_Final(f->sha1_digest, &f->sha1_ctx);
+        f->has_checksum = TRUE;
+    }
+
+    if (total != mem->size || fseek(mem->file, 0, SEEK_SET) != 0) {
+        return MEMFILE_READ_ERROR;
+    }
+
+    __atomic_fetch_add(&MediaBufferSpilledCount, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int memfile_open_spill_capped(scan_media_ctx_t *ctx, vfile_t *f, memfile_t *mem) {
+    if (mem->size > ctx->max_media_spill) {
+        return -1;
+    }
+    return memfile_open_spill(ctx, f, mem);
+}
+
+/**
+ * Buffer the file in memory if it fits in the global media buffer budget,
+ * otherwise in a temporary file (up to max_media_spill bytes). Both are seekable.
+ *
+ * @return 0 on success, -1 if nothing was read, MEMFILE_READ_ERROR otherwise
+ */
+int memfile_open(scan_media_ctx_t *ctx, vfile_t *f, memfile_t *mem) {
     mem->size = f->info.st_size;
 
+    if (!media_buffer_reserve(ctx, (long) mem->size)) {
+        return memfile_open_spill_capped(ctx, f, mem);
+    }
+    if (ctx->mem_reserve != NULL && !ctx->mem_reserve(mem->size)) {
+        media_buffer_release((long) mem->size);
+        return memfile_open_spill_capped(ctx, f, mem);
+    }
+    mem->reserved = mem->size;
+    mem->mem_release = ctx->mem_release;
+
     mem->buf = malloc(mem->size);
     if (mem->buf == NULL) {
         return -1;
@@ -623,7 +1223,7 @@ int memfile_open(vfile_t *f, memfile_t *mem) {
         f->has_checksum = TRUE;
     }
 
-    return (ret == mem->size && mem->file != NULL) ? 0 : -1;
+    return (ret == mem->size && mem->file != NULL) ? 0 : MEMFILE_READ_ERROR;
 }
 
 int memfile_open_buf(void *buf, size_t buf_len, memfile_t *mem) {
@@ -636,9 +1236,15 @@ int memfile_open_buf(void *buf, size_t buf_len, memfile_t *mem) {
 }
 
 void memfile_close(memfile_t *mem) {
+    if (mem->file != NULL) {
+        fclose(mem->file);
+    }
     if (mem->buf != NULL) {
         free(mem->buf);
-        fclose(mem->file);
+    }
+    media_buffer_release((long) mem->reserved);
+    if (mem->mem_release != NULL) {
+        mem->mem_release(mem->reserved);
     }
 }
 
@@ -652,24 +1258,33 @@ void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc,
 
     unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
     AVIOContext *io_ctx = NULL;
-    memfile_t memfile = {0, 0, 0};
+    memfile_t memfile = {0, 0, 0, 0, NULL};
 
     const char *filepath = get_filepath_with_ext(doc, f->filepath, mime_str);
 
-    if (f->info.st_size <= ctx->max_media_buffer) {
-        int ret = memfile_open(f, &memfile);
+    if (f->info.st_size > 0) {
+        int ret = memfile_open(ctx, f, &memfile);
+        if (ret == MEMFILE_READ_ERROR) {
+            CTX_LOG_ERROR(doc->filepath, "(media.c) Could not buffer media file")
+            av_free(buffer);
+            memfile_close(&memfile);
+            avformat_free_context(pFormatCtx);
+            return;
+        }
         if (ret == 0) {
-            CTX_LOG_DEBUGF(f->filepath, "Loading media file in memory (%ldB)", f->info.st_size)
+            CTX_LOG_DEBUGF(f->filepath, "Loading media file in %s (%ldB)",
+                           memfile.buf != NULL ? "memory" : "temporary file", f->info.st_size)
             io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, &memfile, memfile_read, NULL, memfile_seek);
         }
     }
 
     if (io_ctx == NULL) {
-        CTX_LOG_DEBUGF(f->filepath, "Reading media file without seek support", f->info.st_size)
+        CTX_LOG_DEBUGF(f->filepath, "Reading media file without seek support (%ldB)", f->info.st_size)
         io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, f, vfile_read, NULL, NULL);
     }
 
     pFormatCtx->pb = io_ctx;
+    set_probe_limits(ctx, pFormatCtx);
 
     int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
     if (res < 0) {
@@ -684,7 +1299,7 @@ void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc,
         return;
     }
 
-    parse_media_format_ctx(ctx, pFormatCtx, doc);
+    parse_media_format_ctx(ctx, pFormatCtx, doc, NULL);
     av_free(io_ctx->buffer);
     avio_context_free(&io_ctx);
     memfile_close(&memfile);
@@ -704,7 +1319,7 @@ void init_media() {
 }
 
 int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url) {
-    memfile_t memfile = {0, 0, 0};
+    memfile_t memfile = {0, 0, 0, 0, NULL};
     AVIOContext *io_ctx = NULL;
 
     AVFormatContext *pFormatCtx = avformat_alloc_context();
@@ -744,6 +1359,7 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
     const AVCodec *video_codec = avcodec_find_decoder(stream->codecpar->codec_id);
     AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
     avcodec_parameters_to_context(decoder, stream->codecpar);
+    decoder->lowres = thumbnail_lowres(ctx->tn_size, &ctx->tn_tiers, video_codec, stream->codecpar);
     avcodec_open2(decoder, video_codec, NULL);
 
     frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, 0, doc);
@@ -777,8 +1393,8 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
                    frame_and_packet->packet->size);
     } else {
         // Encode frame to jpeg
-        AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(scaled_frame->width, scaled_frame->height,
-                                                          ctx->tn_qscale);
+        AVCodecContext *jpeg_encoder = get_jpeg_encoder(scaled_frame->width, scaled_frame->height,
+                                                        ctx->tn_qscale);
         avcodec_send_frame(jpeg_encoder, scaled_frame);
 
         AVPacket jpeg_packet;
@@ -790,11 +1406,12 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
 
         av_packet_unref(&jpeg_packet);
-        avcodec_free_context(&jpeg_encoder);
         av_free(*scaled_frame->data);
         av_frame_free(&scaled_frame);
     }
 
+    store_thumbnail_tiers(ctx, decoder, frame_and_packet, doc);
+
     frame_and_packet_free(frame_and_packet);
     avcodec_free_context(&decoder);
 
@@ -17,8 +17,20 @@ typedef struct {
 
     int tn_size;
     float tn_qscale;
+    thumbnail_tiers_t tn_tiers;
     long max_media_buffer;
+    // Larger files that do not fit in the buffer are read without seek support
+    long max_media_spill;
+    // Directory of the temporary files, with a trailing slash. Can be NULL ($TMPDIR or /tmp)
+    const char *spill_dir;
     int read_subtitles;
+    int fast_video_tn;
+    long probe_size;
+    long analyze_duration;
+    int fast_probe;
+    // Can be NULL
+    mem_reserve_callback_t mem_reserve;
+    mem_release_callback_t mem_release;
 
     const char *tesseract_lang;
     const char *tesseract_path;
@@ -46,6 +58,30 @@ static AVCodecContext *alloc_jpeg_encoder(int w, int h, float qscale) {
 }
 
 
+/**
+ * Scaling context cached by the calling thread, see sws_getCachedContext().
+ * It must not be freed.
+ */
+struct SwsContext *get_sws_context(int src_w, int src_h, enum AVPixelFormat src_fmt,
+                                   int dst_w, int dst_h, enum AVPixelFormat dst_fmt, int flags);
+
+/**
+ * MJPEG encoder cached by the calling thread for these dimensions and
+ * qscale. It must not be freed.
+ */
+AVCodecContext *get_jpeg_encoder(int w, int h, float qscale);
+
+/**
+ * Free the scaling contexts and encoders cached by the calling thread
+ */
+void cleanup_media();
+
+/**
+ * Log the bytes read by the demuxers, and the number of video thumbnails
+ * and the time spent on them, by codec
+ */
+void media_log_stats(scan_media_ctx_t *ctx);
+
 void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char*mime_str);
 
 void init_media();
@@ -36,10 +36,10 @@ int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, do
 
     AVFrame *scaled_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
+    struct SwsContext *sws_ctx = get_sws_context(
             img->width, img->height, AV_PIX_FMT_RGB24,
             dstW, dstH, AV_PIX_FMT_YUVJ420P,
-            SIST_SWS_ALGO, 0, 0, 0
+            SIST_SWS_ALGO
     );
 
     int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, dstW, dstH, 1);
@@ -60,9 +60,7 @@ int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, do
     scaled_frame->height = dstH;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
-
-    AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(scaled_frame->width, scaled_frame->height, 1.0f);
+    AVCodecContext *jpeg_encoder = get_jpeg_encoder(scaled_frame->width, scaled_frame->height, 1.0f);
     avcodec_send_frame(jpeg_encoder, scaled_frame);
 
     AVPacket jpeg_packet;
@@ -75,7 +73,6 @@ int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, do
     av_packet_unref(&jpeg_packet);
     av_free(*scaled_frame->data);
     av_frame_free(&scaled_frame);
-    avcodec_free_context(&jpeg_encoder);
 
     return TRUE;
 }
@@ -10,6 +10,7 @@ typedef struct {
 
     int tn_size;
     float tn_qscale;
+    thumbnail_tiers_t tn_tiers;
 } scan_raw_ctx_t;
 
 void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc);
@@ -6,6 +6,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
@@ -18,10 +19,28 @@
 
 typedef void (*store_callback_t)(char *key, size_t key_len, char *buf, size_t buf_len);
 
+#define MAX_THUMBNAIL_TIERS 4
+
+/**
+ * Thumbnail sizes generated in addition to tn_size
+ */
+typedef struct {
+    int count;
+    int sizes[MAX_THUMBNAIL_TIERS];
+} thumbnail_tiers_t;
+
 typedef void (*logf_callback_t)(const char *filepath, int level, char *format, ...);
 
 typedef void (*log_callback_t)(const char *filepath, int level, char *str);
 
+/**
+ * Reserve memory from the process-wide budget without waiting
+ * @return TRUE if the memory was reserved
+ */
+typedef int (*mem_reserve_callback_t)(size_t size);
+
+typedef void (*mem_release_callback_t)(size_t size);
+
 typedef int scan_code_t;
 #define SCAN_OK (scan_code_t) 0
 #define SCAN_ERR_READ (scan_code_t) (-1)
@@ -110,11 +129,29 @@ typedef struct document {
     short base;
     short ext;
     char has_parent;
+    // The file was not parsed, only its metadata is indexed
+    char deferred;
     meta_line_t *meta_head;
     meta_line_t *meta_tail;
     char *filepath;
 } document_t;
 
+/**
+ * Store key of the thumbnail of a document at a tier size: the md5 of the
+ * path md5 followed by the size (uint32, little endian)
+ */
+__always_inline
+static void thumbnail_tier_key(const unsigned char path_md5[MD5_DIGEST_LENGTH], int size,
+                               unsigned char key[MD5_DIGEST_LENGTH]) {
+    unsigned char buf[MD5_DIGEST_LENGTH + 4];
+    memcpy(buf, path_md5, MD5_DIGEST_LENGTH);
+    buf[MD5_DIGEST_LENGTH] = size & 0xFF;
+    buf[MD5_DIGEST_LENGTH + 1] = (size >> 8) & 0xFF;
+    buf[MD5_DIGEST_LENGTH + 2] = (size >> 16) & 0xFF;
+    buf[MD5_DIGEST_LENGTH + 3] = (size >> 24) & 0xFF;
+    MD5(buf, sizeof(buf), key);
+}
+
 typedef struct vfile vfile_t;
 
 __attribute__((warn_unused_result))